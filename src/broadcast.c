@@ -0,0 +1,145 @@
+#include "websocket.h"
+
+// Pick the shared frames for a client; returns their count, or 0 if it
+// needs its own encoding
+static size_t ws_broadcast_frames(ws_broadcast_t *broadcast, ws_client_t *client, ws_shared_buffer_t ***frames) {
+    const ws_deflate_params_t *params = &client->deflate;
+
+    // Any other extension transforms each message itself
+    if (client->extension_count > (params->enabled ? 1 : 0)) return 0;
+
+    *frames = broadcast->frames;
+
+    if (!params->enabled || broadcast->length < client->server->deflate_threshold ||
+        (broadcast->opcode != WS_TEXT && broadcast->opcode != WS_BINARY)) {
+        return broadcast->frame_count;
+    }
+
+    // With context takeover the output depends on what this client was sent
+    // before, and a client that asked for a smaller window needs its own copy
+    const ws_deflate_params_t *limits = &client->server->deflate_limits;
+    if (!params->server_no_context_takeover || params->server_max_window_bits != limits->server_max_window_bits) {
+        return 0;
+    }
+
+    if (!broadcast->compressed && !broadcast->compress_failed) {
+        broadcast->compressed = ws_deflate_frame_encode(limits, broadcast->opcode, broadcast->data, broadcast->length);
+        broadcast->compress_failed = !broadcast->compressed;
+    }
+
+    if (!broadcast->compressed) return broadcast->frame_count;
+
+    *frames = &broadcast->compressed;
+    return 1;
+}
+
+// Queue the message to one client; with a generation, only if the slot
+// still holds that connection
+int ws_broadcast_send(ws_broadcast_t *broadcast, ws_client_t *client, uint32_t generation) {
+    ws_shared_buffer_t **frames;
+    size_t count = ws_broadcast_frames(broadcast, client, &frames);
+    int result = count ? ws_client_send_shared_frames_to(client, generation, frames, count)
+                       : ws_client_send_frame_to(client, generation, broadcast->opcode, broadcast->data,
+                                                 broadcast->length);
+
+    if (result >= 0) {
+        broadcast->queued++;
+    }
+    return result;
+}
+
+static void ws_broadcast_visit(ws_client_t *client, void *ctx) {
+    ws_broadcast_t *broadcast = (ws_broadcast_t*)ctx;
+
+    // Read first, so a slot reused after the checks below is not sent to
+    uint32_t generation = __atomic_load_n(&client->generation, __ATOMIC_RELAXED);
+
+    if (client->state != WS_STATE_OPEN) return;
+    if (broadcast->filter && !broadcast->filter(client)) return;
+
+    ws_broadcast_send(broadcast, client, generation);
+}
+
+// Encode a data message as frames of at most step payload bytes; returns a
+// pool array of count shared buffers, or NULL
+static ws_shared_buffer_t** ws_broadcast_fragment(ws_opcode_t opcode, const uint8_t *data, size_t length,
+                                                  size_t step, size_t *count) {
+    size_t frames = (length + step - 1) / step;
+    ws_shared_buffer_t **fragments = ws_pool_alloc(frames * sizeof(*fragments));
+    if (!fragments) return NULL;
+
+    for (size_t i = 0; i < frames; i++) {
+        uint8_t header[WS_MAX_HEADER_SIZE];
+        size_t offset = i * step;
+        size_t chunk = length - offset > step ? step : length - offset;
+        size_t header_len = ws_fragment_header_encode(header, i ? WS_CONTINUATION : opcode, chunk, i + 1 == frames);
+
+        fragments[i] = ws_shared_buffer_create(header_len + chunk);
+        if (!fragments[i]) {
+            while (i > 0) ws_shared_buffer_release(fragments[--i]);
+            ws_pool_free(fragments);
+            return NULL;
+        }
+        memcpy(fragments[i]->data, header, header_len);
+        memcpy(fragments[i]->data + header_len, data + offset, chunk);
+    }
+
+    *count = frames;
+    return fragments;
+}
+
+// Encode a message for fan-out. Large messages go out in fragments so
+// pings can pass between them.
+int ws_broadcast_begin(ws_broadcast_t *broadcast, ws_server_t *server, ws_opcode_t opcode, const uint8_t *data,
+                       size_t length) {
+    broadcast->opcode = opcode;
+    broadcast->data = data;
+    broadcast->length = length;
+    broadcast->frame = NULL;
+    broadcast->frames = &broadcast->frame;
+    broadcast->frame_count = 1;
+    broadcast->compressed = NULL;
+    broadcast->compress_failed = 0;
+    broadcast->filter = NULL;
+    broadcast->queued = 0;
+
+    if (server->fragment_size && length > server->fragment_size && !(opcode & 0x08)) {
+        broadcast->frames = ws_broadcast_fragment(opcode, data, length, server->fragment_size,
+                                                  &broadcast->frame_count);
+        return broadcast->frames ? 0 : -1;
+    }
+
+    broadcast->frame = ws_frame_encode(opcode, data, length);
+    return broadcast->frame ? 0 : -1;
+}
+
+// Drop our references; queues hold their own
+void ws_broadcast_end(ws_broadcast_t *broadcast) {
+    for (size_t i = 0; i < broadcast->frame_count; i++) {
+        ws_shared_buffer_release(broadcast->frames[i]);
+    }
+    if (broadcast->frames != &broadcast->frame) {
+        ws_pool_free(broadcast->frames);
+    }
+    ws_shared_buffer_release(broadcast->compressed);
+}
+
+// Encode the frame once and hand the same immutable buffer to every open
+// client the filter accepts (all of them when filter is NULL). Clients using
+// permessage-deflate without context takeover share one compressed copy;
+// those with context takeover are compressed individually. A plain message
+// longer than fragment_size is shared as one buffer per fragment.
+// Returns the number of clients it was queued to, or -1.
+int ws_server_broadcast(ws_server_t *server, ws_opcode_t opcode, const uint8_t *data, size_t length,
+                        ws_client_filter_t filter) {
+    if (!server) return -1;
+
+    ws_broadcast_t broadcast;
+    if (ws_broadcast_begin(&broadcast, server, opcode, data, length) < 0) return -1;
+
+    broadcast.filter = filter;
+    ws_server_foreach_client(server, ws_broadcast_visit, &broadcast);
+
+    ws_broadcast_end(&broadcast);
+    return broadcast.queued;
+}
@@ -1,12 +1,12 @@
 #include "websocket.h"
 
 ws_buffer_t* ws_buffer_create(size_t initial_capacity) {
-    ws_buffer_t *buffer = malloc(sizeof(ws_buffer_t));
+    ws_buffer_t *buffer = ws_pool_alloc(sizeof(ws_buffer_t));
     if (!buffer) return NULL;
 
-    buffer->data = malloc(initial_capacity);
+    buffer->data = ws_pool_alloc(initial_capacity);
     if (!buffer->data) {
-        free(buffer);
+        ws_pool_free(buffer);
         return NULL;
     }
 
@@ -17,8 +17,8 @@ ws_buffer_t* ws_buffer_create(size_t initial_capacity) {
 
 void ws_buffer_destroy(ws_buffer_t *buffer) {
     if (buffer) {
-        free(buffer->data);
-        free(buffer);
+        ws_pool_free(buffer->data);
+        ws_pool_free(buffer);
     }
 }
 
@@ -29,7 +29,7 @@ int ws_buffer_append(ws_buffer_t *buffer, const uint8_t *data, size_t length) {
             new_capacity *= 2;
         }
 
-        uint8_t *new_data = realloc(buffer->data, new_capacity);
+        uint8_t *new_data = ws_pool_realloc(buffer->data, new_capacity);
         if (!new_data) return -1;
 
         buffer->data = new_data;
@@ -45,61 +45,254 @@ void ws_buffer_clear(ws_buffer_t *buffer) {
     buffer->size = 0;
 }
 
-// Base64 encoding/decoding
-char* ws_base64_encode(const uint8_t *data, size_t length) {
-    BIO *bio, *b64;
-    BUF_MEM *buffer_ptr;
+// Base64 encoding/decoding (RFC 4648, with padding) on caller buffers
+static const char ws_base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_new(BIO_s_mem());
-    bio = BIO_push(b64, bio);
+// Writes WS_BASE64_ENCODED_SIZE(length) bytes including the NUL; returns
+// the encoded length
+size_t ws_base64_encode(const uint8_t *data, size_t length, char *output) {
+    char *out = output;
+    size_t i = 0;
 
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    BIO_write(bio, data, length);
-    BIO_flush(bio);
+    for (; i + 3 <= length; i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 | data[i + 2];
+        *out++ = ws_base64_alphabet[group >> 18];
+        *out++ = ws_base64_alphabet[(group >> 12) & 0x3f];
+        *out++ = ws_base64_alphabet[(group >> 6) & 0x3f];
+        *out++ = ws_base64_alphabet[group & 0x3f];
+    }
 
-    BIO_get_mem_ptr(bio, &buffer_ptr);
+    if (i < length) {
+        uint32_t group = (uint32_t)data[i] << 16 | (i + 1 < length ? (uint32_t)data[i + 1] << 8 : 0);
+        *out++ = ws_base64_alphabet[group >> 18];
+        *out++ = ws_base64_alphabet[(group >> 12) & 0x3f];
+        *out++ = i + 1 < length ? ws_base64_alphabet[(group >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
 
-    char *result = malloc(buffer_ptr->length + 1);
-    memcpy(result, buffer_ptr->data, buffer_ptr->length);
-    result[buffer_ptr->length] = '\0';
+    *out = '\0';
+    return out - output;
+}
 
-    BIO_free_all(bio);
-    return result;
+static int ws_base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
 }
 
-int ws_base64_decode(const char *input, uint8_t *output, size_t *output_length) {
-    BIO *bio, *b64;
-    int decode_len = strlen(input);
+// Strict decode: padded input, no whitespace. *output_length holds the
+// capacity of output on entry and the decoded length on success.
+int ws_base64_decode(const char *input, size_t input_len, uint8_t *output, size_t *output_length) {
+    size_t padding = 0;
+
+    if (input_len % 4 != 0) return -1;
+    if (input_len > 0 && input[input_len - 1] == '=') padding++;
+    if (input_len > 1 && input[input_len - 2] == '=') padding++;
 
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_new_mem_buf(input, decode_len);
-    bio = BIO_push(b64, bio);
+    size_t decoded_len = input_len / 4 * 3 - padding;
+    if (decoded_len > *output_length) return -1;
 
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    *output_length = BIO_read(bio, output, decode_len);
+    size_t out = 0;
+    for (size_t i = 0; i < input_len; i += 4) {
+        int last = i + 4 == input_len;
+        int v0 = ws_base64_value(input[i]);
+        int v1 = ws_base64_value(input[i + 1]);
+        int v2 = last && padding == 2 ? 0 : ws_base64_value(input[i + 2]);
+        int v3 = last && padding >= 1 ? 0 : ws_base64_value(input[i + 3]);
+        if ((v0 | v1 | v2 | v3) < 0) return -1;
 
-    BIO_free_all(bio);
-    return (*output_length > 0) ? 0 : -1;
+        uint32_t group = (uint32_t)v0 << 18 | (uint32_t)v1 << 12 | (uint32_t)v2 << 6 | (uint32_t)v3;
+        output[out++] = group >> 16;
+        if (out < decoded_len) output[out++] = (group >> 8) & 0xff;
+        if (out < decoded_len) output[out++] = group & 0xff;
+    }
+
+    *output_length = decoded_len;
+    return 0;
 }
 
-// Generate WebSocket accept key
+// Generate WebSocket accept key: base64(SHA-1(key + GUID)) into a buffer of
+// at least WS_ACCEPT_KEY_SIZE bytes
 void ws_generate_accept_key(const char *client_key, char *accept_key) {
-    char combined[256];
-    unsigned char sha1_hash[SHA_DIGEST_LENGTH];
+    uint8_t digest[WS_SHA1_DIGEST_SIZE];
+    ws_sha1_t sha1;
 
-    snprintf(combined, sizeof(combined), "%s%s", client_key, WS_MAGIC_STRING);
+    ws_sha1_init(&sha1);
+    ws_sha1_update(&sha1, (const uint8_t*)client_key, strlen(client_key));
+    ws_sha1_update(&sha1, (const uint8_t*)WS_MAGIC_STRING, WS_MAGIC_STRING_LEN);
+    ws_sha1_final(&sha1, digest);
 
-    SHA1((unsigned char*)combined, strlen(combined), sha1_hash);
+    ws_base64_encode(digest, sizeof(digest), accept_key);
+}
+
+// Milliseconds on a clock that never jumps; for deadlines and timeouts
+uint64_t ws_monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    char *encoded = ws_base64_encode(sha1_hash, SHA_DIGEST_LENGTH);
-    strcpy(accept_key, encoded);
-    free(encoded);
+uint64_t ws_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 // Apply WebSocket mask
-void ws_apply_mask(uint8_t *data, size_t length, const uint8_t *mask) {
+//
+// Kernels are picked once at startup from the CPU features: AVX2 or SSE2 on
+// x86, NEON on ARM, otherwise 64-bit words. Unaligned heads and short tails
+// go through the scalar loop with the mask rotated to the right offset, so
+// every kernel produces byte-identical output.
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WS_MASK_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WS_MASK_NEON 1
+#endif
+
+typedef void (*ws_mask_fn)(uint8_t *data, size_t length, const uint8_t *mask);
+
+static void ws_apply_mask_scalar(uint8_t *data, size_t length, const uint8_t *mask) {
     for (size_t i = 0; i < length; i++) {
-        data[i] ^= mask[i % 4];
+        data[i] ^= mask[i & 3];
+    }
+}
+
+// Mask the bytes up to the next align boundary and rotate the mask to match.
+// Returns the number of bytes handled.
+static size_t ws_mask_head(uint8_t *data, size_t length, const uint8_t *mask,
+                           size_t align, uint8_t *rotated) {
+    size_t head = (align - ((uintptr_t)data & (align - 1))) & (align - 1);
+    if (head > length) head = length;
+
+    ws_apply_mask_scalar(data, head, mask);
+
+    for (int i = 0; i < 4; i++) {
+        rotated[i] = mask[(head + i) & 3];
+    }
+
+    return head;
+}
+
+static void ws_apply_mask_word(uint8_t *data, size_t length, const uint8_t *mask) {
+    uint8_t rotated[4];
+    uint8_t pattern[8];
+    uint64_t mask64;
+
+    size_t i = ws_mask_head(data, length, mask, sizeof(uint64_t), rotated);
+    memcpy(pattern, rotated, 4);
+    memcpy(pattern + 4, rotated, 4);
+    memcpy(&mask64, pattern, sizeof(mask64));
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word ^= mask64;
+        memcpy(data + i, &word, sizeof(word));
+    }
+
+    ws_apply_mask_scalar(data + i, length - i, rotated);
+}
+
+#ifdef WS_MASK_X86
+__attribute__((target("sse2")))
+static void ws_apply_mask_sse2(uint8_t *data, size_t length, const uint8_t *mask) {
+    uint8_t rotated[4];
+    uint32_t mask32;
+
+    size_t i = ws_mask_head(data, length, mask, 16, rotated);
+    memcpy(&mask32, rotated, sizeof(mask32));
+    __m128i mask128 = _mm_set1_epi32((int)mask32);
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_load_si128((const __m128i*)(data + i));
+        _mm_store_si128((__m128i*)(data + i), _mm_xor_si128(block, mask128));
+    }
+
+    ws_apply_mask_scalar(data + i, length - i, rotated);
+}
+
+__attribute__((target("avx2")))
+static void ws_apply_mask_avx2(uint8_t *data, size_t length, const uint8_t *mask) {
+    uint8_t rotated[4];
+    uint32_t mask32;
+
+    size_t i = ws_mask_head(data, length, mask, 32, rotated);
+    memcpy(&mask32, rotated, sizeof(mask32));
+    __m256i mask256 = _mm256_set1_epi32((int)mask32);
+
+    for (; i + 64 <= length; i += 64) {
+        __m256i a = _mm256_load_si256((const __m256i*)(data + i));
+        __m256i b = _mm256_load_si256((const __m256i*)(data + i + 32));
+        _mm256_store_si256((__m256i*)(data + i), _mm256_xor_si256(a, mask256));
+        _mm256_store_si256((__m256i*)(data + i + 32), _mm256_xor_si256(b, mask256));
+    }
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_load_si256((const __m256i*)(data + i));
+        _mm256_store_si256((__m256i*)(data + i), _mm256_xor_si256(block, mask256));
+    }
+
+    ws_apply_mask_scalar(data + i, length - i, rotated);
+}
+#endif
+
+#ifdef WS_MASK_NEON
+static void ws_apply_mask_neon(uint8_t *data, size_t length, const uint8_t *mask) {
+    uint8_t rotated[4];
+    uint32_t mask32;
+
+    size_t i = ws_mask_head(data, length, mask, 16, rotated);
+    memcpy(&mask32, rotated, sizeof(mask32));
+    uint8x16_t mask128 = vreinterpretq_u8_u32(vdupq_n_u32(mask32));
+
+    for (; i + 16 <= length; i += 16) {
+        vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), mask128));
+    }
+
+    ws_apply_mask_scalar(data + i, length - i, rotated);
+}
+#endif
+
+static ws_mask_fn ws_mask_impl = ws_apply_mask_word;
+static const char *ws_mask_impl_name = "word";
+static pthread_once_t ws_mask_once = PTHREAD_ONCE_INIT;
+
+static void ws_mask_select(void) {
+#ifdef WS_MASK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ws_mask_impl = ws_apply_mask_avx2;
+        ws_mask_impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        ws_mask_impl = ws_apply_mask_sse2;
+        ws_mask_impl_name = "sse2";
     }
+#elif defined(WS_MASK_NEON)
+    ws_mask_impl = ws_apply_mask_neon;
+    ws_mask_impl_name = "neon";
+#endif
+}
+
+// Name of the kernel ws_apply_mask dispatches to
+const char* ws_mask_kernel(void) {
+    pthread_once(&ws_mask_once, ws_mask_select);
+    return ws_mask_impl_name;
+}
+
+void ws_apply_mask(uint8_t *data, size_t length, const uint8_t *mask) {
+    // Not worth a dispatch for tiny control frames
+    if (length < 16) {
+        ws_apply_mask_scalar(data, length, mask);
+        return;
+    }
+
+    pthread_once(&ws_mask_once, ws_mask_select);
+    ws_mask_impl(data, length, mask);
 }
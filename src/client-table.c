@@ -0,0 +1,154 @@
+#include "websocket.h"
+
+// Slots come in WS_CLIENT_CHUNK sized chunks that are added only when every
+// existing slot is busy, so an idle server doesn't pay for max_clients up
+// front. Chunks never move, which keeps client pointers (epoll data, thread
+// arguments) valid until the table is destroyed. Unused slots are linked
+// through next_free, the most recently released (still cache-warm) on top,
+// so acquire and release are O(1), and a slot is found from its index with
+// one division.
+
+static int ws_client_table_chunk_size(ws_client_table_t *table, int chunk) {
+    int remaining = table->max_clients - chunk * WS_CLIENT_CHUNK;
+    return remaining < WS_CLIENT_CHUNK ? remaining : WS_CLIENT_CHUNK;
+}
+
+int ws_client_table_init(ws_client_table_t *table, int max_clients, ws_server_t *server, ws_worker_t *worker) {
+    table->max_clients = max_clients;
+    table->max_chunks = (max_clients + WS_CLIENT_CHUNK - 1) / WS_CLIENT_CHUNK;
+    table->chunk_count = 0;
+    table->free_head = -1;
+    table->first_slot = worker ? (uint32_t)worker->index * (uint32_t)max_clients : 0;
+    table->server = server;
+    table->worker = worker;
+    table->chunks = calloc(table->max_chunks, sizeof(ws_client_t*));
+    return table->chunks ? 0 : -1;
+}
+
+ws_client_t* ws_client_table_slot(ws_client_table_t *table, int index) {
+    int chunk = index / WS_CLIENT_CHUNK;
+
+    if (index < 0 || chunk >= __atomic_load_n(&table->chunk_count, __ATOMIC_ACQUIRE)) return NULL;
+    return &table->chunks[chunk][index % WS_CLIENT_CHUNK];
+}
+
+// Add a chunk and put its slots on the free list
+static int ws_client_table_grow(ws_client_table_t *table) {
+    int index = table->chunk_count;
+    if (index >= table->max_chunks) return -1;
+
+    int size = ws_client_table_chunk_size(table, index);
+    ws_client_t *clients = calloc(size, sizeof(ws_client_t));
+    if (!clients) return -1;
+
+    ws_server_t *server = table->server;
+    for (int i = 0; i < size; i++) {
+        pthread_mutex_init(&clients[i].mutex, NULL);
+        clients[i].buffer = NULL; // Receive buffer is taken from the pool per connection
+        clients[i].buffer_size = BUFFER_SIZE;
+        clients[i].connected = 0;
+        clients[i].slot = table->first_slot + index * WS_CLIENT_CHUNK + i;
+        clients[i].generation = 1;
+        clients[i].next_free = i + 1 < size ? index * WS_CLIENT_CHUNK + i + 1 : table->free_head;
+        clients[i].server = server;
+        clients[i].worker = table->worker;
+        clients[i].state = WS_STATE_CLOSED;
+        ws_write_queue_init(&clients[i].write_queue);
+        pthread_cond_init(&clients[i].writable, NULL);
+        clients[i].write_blocked = 0;
+        clients[i].wake_fd = -1;
+        ws_parser_init(&clients[i].parser, server->max_payload_size, 1);
+        clients[i].parser.zero_copy = server->zero_copy;
+    }
+
+    table->chunks[index] = clients;
+    table->free_head = index * WS_CLIENT_CHUNK;
+
+    // Publish the chunk only once its slots are initialized
+    __atomic_store_n(&table->chunk_count, index + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Claim a free slot, growing the table if needed. The caller must serialize
+// acquires and releases (one owner thread, or a lock). Returns NULL when the
+// table is full.
+ws_client_t* ws_client_table_acquire(ws_client_table_t *table) {
+    if (table->free_head < 0 && ws_client_table_grow(table) < 0) return NULL;
+
+    ws_client_t *client = &table->chunks[table->free_head / WS_CLIENT_CHUNK][table->free_head % WS_CLIENT_CHUNK];
+    table->free_head = client->next_free;
+    client->connected = 1;
+    return client;
+}
+
+// Return a slot whose connection is over. Its generation moves on, so ids
+// handed out for the connection stop matching.
+void ws_client_table_release(ws_client_table_t *table, ws_client_t *client) {
+    uint32_t generation = client->generation + 1;
+
+    // Under the mutex so ws_server_send_to sees the old or the new value whole
+    pthread_mutex_lock(&client->mutex);
+    __atomic_store_n(&client->generation, generation ? generation : 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&client->mutex);
+
+    client->connected = 0;
+    client->next_free = table->free_head;
+    table->free_head = client->slot - table->first_slot;
+}
+
+void ws_client_table_foreach(ws_client_table_t *table, ws_client_visitor_t visit, void *ctx) {
+    int chunk_count = __atomic_load_n(&table->chunk_count, __ATOMIC_ACQUIRE);
+
+    for (int c = 0; c < chunk_count; c++) {
+        ws_client_t *clients = table->chunks[c];
+        int size = ws_client_table_chunk_size(table, c);
+
+        for (int i = 0; i < size; i++) {
+            if (clients[i].connected) {
+                visit(&clients[i], ctx);
+            }
+        }
+    }
+}
+
+void ws_client_table_destroy(ws_client_table_t *table) {
+    if (!table->chunks) return;
+
+    for (int c = 0; c < table->chunk_count; c++) {
+        ws_client_t *clients = table->chunks[c];
+        int size = ws_client_table_chunk_size(table, c);
+
+        // Close connections still open the way the I/O models do, so their
+        // extension contexts, partial messages and limiter shares go back
+        // while the server's limiter and topic tables still exist
+        for (int i = 0; i < size; i++) {
+            ws_client_t *client = &clients[i];
+
+            if (client->connected) {
+                int was_open = client->state == WS_STATE_OPEN || client->state == WS_STATE_CLOSING;
+
+                pthread_mutex_lock(&client->mutex);
+                client->state = WS_STATE_CLOSED;
+                close(client->socket);
+                pthread_mutex_unlock(&client->mutex);
+
+                if (was_open) {
+                    ws_client_emit_close(client);
+                }
+                ws_client_reset(client);
+            }
+            ws_pool_free(clients[i].buffer);
+            ws_write_queue_clear(&clients[i].write_queue);
+            pthread_cond_destroy(&clients[i].writable);
+            ws_parser_destroy(&clients[i].parser);
+            free(clients[i].subscriptions);
+            pthread_mutex_destroy(&clients[i].mutex);
+        }
+
+        free(clients);
+    }
+
+    free(table->chunks);
+    table->chunks = NULL;
+    table->chunk_count = 0;
+}
@@ -0,0 +1,419 @@
+#include "websocket.h"
+
+// Sentinel epoll tags for the non-client descriptors
+static int listener_tag;
+static int wake_tag;
+
+// Client sockets are edge-triggered for both directions
+#define WS_CLIENT_EPOLL_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+static void ws_event_loop_close_client(ws_client_t *client);
+static void ws_event_loop_read(ws_client_t *client);
+
+// Keep the client's timer at its nearest deadline (0 for none)
+static void ws_event_loop_schedule(ws_client_t *client, uint64_t deadline) {
+    ws_timer_wheel_t *timers = &client->worker->timers;
+
+    if (deadline) {
+        ws_timer_arm(timers, &client->timer, deadline);
+    } else {
+        ws_timer_cancel(timers, &client->timer);
+    }
+}
+
+// The client's nearest deadline has passed. Deadlines that moved since the
+// timer was armed (bytes arrived, say) are only noticed here, so traffic
+// never touches the wheel.
+static void ws_event_loop_on_timer(void *ctx) {
+    ws_client_t *client = (ws_client_t*)ctx;
+    uint64_t next;
+
+    // Upgrade request not complete in time
+    if (client->state == WS_STATE_HANDSHAKE) {
+        ws_event_loop_close_client(client);
+        return;
+    }
+
+    uint64_t now = ws_monotonic_ms();
+
+    // Back within its receive budget: read what has been waiting
+    if (client->throttled_until && now >= client->throttled_until) {
+        client->throttled_until = 0;
+        ws_event_loop_read(client);
+        if (client->state == WS_STATE_CLOSED) return;
+    }
+
+    if (ws_client_expire(client, now, &next) < 0) {
+        ws_event_loop_close_client(client);
+        return;
+    }
+
+    if (client->throttled_until && (!next || client->throttled_until < next)) {
+        next = client->throttled_until;
+    }
+    ws_event_loop_schedule(client, next);
+}
+
+// Make the owning worker look at the client soon: re-arming an
+// edge-triggered descriptor reports it again if it is writable.
+// Caller must hold client->mutex (so the socket is not closed under us).
+void ws_event_loop_notify_locked(ws_client_t *client) {
+    struct epoll_event ev;
+
+    if (client->state == WS_STATE_CLOSED || !client->worker) return;
+
+    ev.events = WS_CLIENT_EPOLL_EVENTS;
+    ev.data.ptr = client;
+    epoll_ctl(client->worker->epoll_fd, EPOLL_CTL_MOD, client->socket, &ev);
+}
+
+static void ws_event_loop_close_client(ws_client_t *client) {
+    if (client->state == WS_STATE_CLOSED) return;
+
+    ws_timer_cancel(&client->worker->timers, &client->timer);
+
+    int was_open = client->state != WS_STATE_HANDSHAKE;
+
+    pthread_mutex_lock(&client->mutex);
+    client->state = WS_STATE_CLOSED;
+    close(client->socket); // Also removes it from the epoll set
+    pthread_mutex_unlock(&client->mutex);
+
+    if (was_open) {
+        ws_client_emit_close(client);
+    }
+
+    ws_client_reset(client);
+    ws_pool_free(client->buffer);
+    client->buffer = NULL;
+    ws_client_table_release(&client->worker->clients, client);
+}
+
+// Accept at most WS_ACCEPT_BATCH connections per wakeup. The listener is
+// level-triggered, so a deeper backlog brings us straight back here after
+// the other ready sockets have had their turn.
+static void ws_event_loop_accept(ws_worker_t *worker) {
+    for (int i = 0; i < WS_ACCEPT_BATCH; i++) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_socket = accept4(worker->socket, (struct sockaddr*)&client_addr, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            return;
+        }
+
+        // Only the owning worker acquires and releases its slots, so no lock is needed
+        ws_client_t *client = ws_client_table_acquire(&worker->clients);
+        if (!client) {
+            // No free slots
+            close(client_socket);
+            continue;
+        }
+
+        // The receive buffer lives only as long as the connection
+        client->buffer = ws_pool_alloc(client->buffer_size);
+        if (!client->buffer) {
+            close(client_socket);
+            ws_client_table_release(&worker->clients, client);
+            continue;
+        }
+
+        // Initialize client
+        client->socket = client_socket;
+        client->buffer_pos = 0;
+        client->address = client_addr;
+        client->state = WS_STATE_HANDSHAKE;
+        ws_http_parser_init(&client->handshake);
+        ws_timer_init(&client->timer, ws_event_loop_on_timer, client);
+
+        struct epoll_event ev;
+        ev.events = WS_CLIENT_EPOLL_EVENTS;
+        ev.data.ptr = client;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl");
+            client->state = WS_STATE_CLOSED;
+            close(client_socket);
+            ws_pool_free(client->buffer);
+            client->buffer = NULL;
+            ws_client_table_release(&worker->clients, client);
+            continue;
+        }
+
+        int timeout = worker->server->handshake_timeout_ms;
+        client->handshake_deadline = timeout > 0 ? ws_monotonic_ms() + timeout : 0;
+        ws_event_loop_schedule(client, client->handshake_deadline);
+    }
+}
+
+// Parse the newly received part of the upgrade request, answering it once
+// it is complete. Returns 1 when the connection is open, 0 if more data is
+// needed, -1 if it must be dropped.
+static int ws_event_loop_handshake(ws_client_t *client) {
+    ws_http_parser_t *parser = &client->handshake;
+    char response[1024];
+
+    int result = ws_http_parser_feed(parser, client->buffer, client->buffer_pos);
+    if (result == 0) return 0;
+
+    if (result < 0) {
+        // Best effort: the socket buffer is empty, and we close right after
+        int length = ws_handshake_reject(parser->status, response, sizeof(response));
+        if (length > 0) {
+            send(client->socket, response, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        return -1;
+    }
+
+    int response_len = ws_handshake_accept(client, parser, client->buffer, response, sizeof(response));
+    if (response_len < 0) return -1;
+
+    if (ws_client_write_raw(client, (uint8_t*)response, response_len) < 0) return -1;
+
+    size_t request_len = parser->request_length;
+
+    // Keep any bytes that arrived after the request
+    memmove(client->buffer, client->buffer + request_len, client->buffer_pos - request_len);
+    client->buffer_pos -= request_len;
+
+    client->state = WS_STATE_OPEN;
+    client->last_received = client->last_message = ws_monotonic_ms();
+    ws_client_limits_attach(client);
+
+    // Swap the handshake deadline for the heartbeat and idle ones
+    uint64_t next;
+    ws_client_expire(client, client->last_received, &next);
+    ws_event_loop_schedule(client, next);
+
+    ws_client_emit_connection(client);
+    return 1;
+}
+
+// Handle a chunk just appended to the receive buffer.
+// Returns 0 on success, -1 if the connection must be dropped.
+static int ws_event_loop_process(ws_client_t *client, size_t received) {
+    client->buffer_pos += received;
+
+    // Frames pipelined behind the upgrade request stay in the buffer
+    if (client->state == WS_STATE_HANDSHAKE) {
+        int result = ws_event_loop_handshake(client);
+        if (result <= 0) return result;
+    }
+
+    // An answered ping brings the next one closer than the armed pong
+    // deadline; every other arrival only pushes deadlines back
+    uint64_t ping_sent = client->ping_sent;
+
+    // The parser keeps partial frames, so the receive buffer only holds what
+    // a receive limit held back
+    int kept = ws_client_process_data(client, (uint8_t*)client->buffer, client->buffer_pos);
+    client->buffer_pos = kept > 0 ? kept : 0;
+
+    if (ping_sent && client->state == WS_STATE_OPEN) {
+        uint64_t next;
+        ws_client_expire(client, client->last_received, &next);
+        ws_event_loop_schedule(client, next);
+    }
+    return 0;
+}
+
+static void ws_event_loop_read(ws_client_t *client) {
+    // Until then its data stays in the socket; the timer resumes reading
+    if (client->throttled_until) return;
+
+    while (client->state == WS_STATE_HANDSHAKE || client->state == WS_STATE_OPEN || ws_client_awaiting_close(client)) {
+        int wait = ws_client_limits_wait(client);
+        if (wait > 0) {
+            client->throttled_until = ws_monotonic_ms() + wait;
+            if (!ws_timer_pending(&client->timer) ||
+                client->throttled_until < client->timer.expires * WS_TIMER_TICK_MS) {
+                ws_event_loop_schedule(client, client->throttled_until);
+            }
+            return;
+        }
+
+        // Frames held back by a receive limit go before anything newer
+        if (client->state != WS_STATE_HANDSHAKE && client->buffer_pos > 0) {
+            ws_event_loop_process(client, 0);
+            continue;
+        }
+
+        ssize_t bytes_received = recv(client->socket, client->buffer + client->buffer_pos,
+                                      client->buffer_size - client->buffer_pos, 0);
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            ws_event_loop_close_client(client);
+            return;
+        }
+
+        if (bytes_received == 0) {
+            ws_event_loop_close_client(client);
+            return;
+        }
+
+        if (ws_event_loop_process(client, bytes_received) < 0) {
+            ws_event_loop_close_client(client);
+            return;
+        }
+    }
+}
+
+static void ws_event_loop_write(ws_client_t *client) {
+    int result = ws_client_flush(client);
+    if (result < 0 || (result == 0 && client->state == WS_STATE_CLOSING && !ws_client_awaiting_close(client))) {
+        ws_event_loop_close_client(client);
+        return;
+    }
+
+    // Our close is out (or on its way); the peer has until the close deadline
+    if (ws_client_awaiting_close(client)) {
+        ws_event_loop_schedule(client, client->close_deadline);
+    }
+}
+
+// Write out what was corked during the pass: one gather write per connection.
+// What is corked meanwhile waits for the next pass, which does not block.
+static void ws_event_loop_uncork(ws_worker_t *worker) {
+    ws_client_t *client = __atomic_exchange_n(&worker->corked, NULL, __ATOMIC_ACQUIRE);
+
+    while (client) {
+        ws_client_t *next = client->next_corked;
+
+        // Cleared first: frames sent from here on list it again
+        __atomic_store_n(&client->corked, 0, __ATOMIC_RELEASE);
+        if (client->state != WS_STATE_CLOSED) {
+            ws_event_loop_write(client);
+        }
+        client = next;
+    }
+}
+
+static void* ws_event_loop_thread(void *arg) {
+    ws_worker_t *worker = (ws_worker_t*)arg;
+    ws_server_t *server = worker->server;
+    struct epoll_event events[WS_MAX_EVENTS];
+
+    while (server->running) {
+        int timeout = ws_timer_wheel_timeout(&worker->timers, ws_monotonic_ms());
+
+        // Frames corked while uncorking (from on_drain or on_close) went on a
+        // fresh list, and nothing wakes us for those
+        if (__atomic_load_n(&worker->corked, __ATOMIC_ACQUIRE)) {
+            timeout = 0;
+        }
+
+        int count = epoll_wait(worker->epoll_fd, events, WS_MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        ws_timer_wheel_advance(&worker->timers, ws_monotonic_ms());
+
+        for (int i = 0; i < count; i++) {
+            void *tag = events[i].data.ptr;
+
+            if (tag == &listener_tag) {
+                ws_event_loop_accept(worker);
+                continue;
+            }
+
+            if (tag == &wake_tag) {
+                uint64_t value;
+                while (read(worker->wake_fd, &value, sizeof(value)) > 0);
+                continue;
+            }
+
+            ws_client_t *client = (ws_client_t*)tag;
+            uint32_t flags = events[i].events;
+
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                ws_event_loop_read(client);
+            }
+
+            if (client->state != WS_STATE_CLOSED && (flags & EPOLLOUT || client->state == WS_STATE_CLOSING)) {
+                ws_event_loop_write(client);
+            }
+        }
+
+        ws_event_loop_uncork(worker);
+    }
+
+    return NULL;
+}
+
+int ws_worker_init(ws_worker_t *worker, ws_server_t *server, int index, int max_clients) {
+    struct epoll_event ev;
+
+    worker->index = index;
+    worker->socket = -1;
+    worker->server = server;
+    worker->corked = NULL;
+    ws_timer_wheel_init(&worker->timers, ws_monotonic_ms());
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (ws_client_table_init(&worker->clients, max_clients, server, worker) < 0 ||
+        worker->epoll_fd < 0 || worker->wake_fd < 0) {
+        ws_worker_destroy(worker);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) < 0) {
+        ws_worker_destroy(worker);
+        return -1;
+    }
+
+    return 0;
+}
+
+int ws_worker_start(ws_worker_t *worker) {
+    struct epoll_event ev;
+
+    worker->socket = ws_server_listen(worker->server, 1);
+    if (worker->socket < 0) return -1;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener_tag;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->socket, &ev) < 0 ||
+        pthread_create(&worker->thread, NULL, ws_event_loop_thread, worker) != 0) {
+        close(worker->socket);
+        worker->socket = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Interrupt the worker's epoll_wait
+void ws_worker_wake(ws_worker_t *worker) {
+    uint64_t one = 1;
+    if (write(worker->wake_fd, &one, sizeof(one)) < 0) {
+        perror("write");
+    }
+}
+
+void ws_worker_stop(ws_worker_t *worker) {
+    if (worker->socket < 0) return;
+
+    ws_worker_wake(worker);
+    pthread_join(worker->thread, NULL);
+    close(worker->socket);
+    worker->socket = -1;
+}
+
+void ws_worker_destroy(ws_worker_t *worker) {
+    ws_client_table_destroy(&worker->clients);
+
+    if (worker->epoll_fd >= 0) close(worker->epoll_fd);
+    if (worker->wake_fd >= 0) close(worker->wake_fd);
+    worker->epoll_fd = worker->wake_fd = -1;
+}
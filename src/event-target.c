@@ -1,77 +1,201 @@
 #include "websocket.h"
 
-typedef struct ws_event_listener {
-    char *event_type;
+// Named event registry
+//
+// Event types are interned to small integer IDs when first registered.
+// Listeners live in an immutable snapshot: one allocation holding the type
+// names and, for each type, its listeners side by side. Dispatch loads the
+// current snapshot with an acquire and walks only the listeners of its type,
+// so readers take no lock and write nothing shared. Writers serialize on
+// target->mutex, build a new snapshot and publish it with a release store.
+// Replaced snapshots cannot be freed while a dispatch may still be walking
+// them, and registration happens at setup time, so they are kept on a
+// retired list until the target is destroyed.
+
+typedef struct {
     void (*callback)(ws_client_t *client, void *data);
     void *user_data;
-    struct ws_event_listener *next;
 } ws_event_listener_t;
 
-typedef struct ws_event_target_impl {
+typedef struct ws_event_snapshot {
+    struct ws_event_snapshot *retired;  // The snapshot this one replaced
+    int type_count;
+    const char **types;                 // Interned names, indexed by ID
+    int *first;                         // Type t's listeners are first[t] .. first[t + 1] - 1
     ws_event_listener_t *listeners;
-    pthread_mutex_t mutex;
-} ws_event_target_impl_t;
+} ws_event_snapshot_t;
+
+struct ws_event_target_impl {
+    ws_event_snapshot_t *snapshot;      // Current one; loaded lock-free by dispatch
+    pthread_mutex_t mutex;              // Serializes writers
+};
+
+// Allocate a snapshot with room for the given types and listeners
+static ws_event_snapshot_t* ws_event_snapshot_alloc(int type_count, int listener_count) {
+    size_t size = sizeof(ws_event_snapshot_t) + type_count * sizeof(const char*) +
+                  (type_count + 1) * sizeof(int) + listener_count * sizeof(ws_event_listener_t);
+
+    ws_event_snapshot_t *snapshot = malloc(size);
+    if (!snapshot) return NULL;
+
+    // Listeners first: they have the strictest alignment
+    snapshot->listeners = (ws_event_listener_t*)(snapshot + 1);
+    snapshot->types = (const char**)(snapshot->listeners + listener_count);
+    snapshot->first = (int*)(snapshot->types + type_count);
+    snapshot->type_count = type_count;
+    snapshot->retired = NULL;
+    snapshot->first[0] = 0;
+
+    return snapshot;
+}
+
+static int ws_event_snapshot_find(const ws_event_snapshot_t *snapshot, const char *event_type) {
+    for (int i = 0; i < snapshot->type_count; i++) {
+        if (strcmp(snapshot->types[i], event_type) == 0) return i;
+    }
+    return -1;
+}
+
+static void ws_event_snapshot_run(const ws_event_snapshot_t *snapshot, int type, ws_client_t *client, void *data) {
+    const ws_event_listener_t *listener = snapshot->listeners + snapshot->first[type];
+    const ws_event_listener_t *end = snapshot->listeners + snapshot->first[type + 1];
+
+    for (; listener < end; listener++) {
+        listener->callback(client, data);
+    }
+}
+
+// Copy the snapshot, optionally adding a type and one listener for a type
+// (-1 for none), and make the copy current. Caller must hold target->mutex.
+static int ws_event_target_publish_locked(ws_event_target_impl_t *target, const char *new_type, int type,
+                                          const ws_event_listener_t *listener) {
+    ws_event_snapshot_t *old = target->snapshot;
+    int type_count = old->type_count + (new_type != NULL);
+    int listener_count = old->first[old->type_count] + (type >= 0);
+
+    ws_event_snapshot_t *snapshot = ws_event_snapshot_alloc(type_count, listener_count);
+    if (!snapshot) return -1;
+
+    int n = 0;
+    for (int t = 0; t < type_count; t++) {
+        int count = 0;
+
+        if (t < old->type_count) {
+            snapshot->types[t] = old->types[t];
+            count = old->first[t + 1] - old->first[t];
+            memcpy(snapshot->listeners + n, old->listeners + old->first[t], count * sizeof(ws_event_listener_t));
+        } else {
+            snapshot->types[t] = new_type;
+        }
+
+        // New listeners run after the ones already registered
+        if (t == type) snapshot->listeners[n + count++] = *listener;
+
+        n += count;
+        snapshot->first[t + 1] = n;
+    }
+
+    snapshot->retired = old;
+    __atomic_store_n(&target->snapshot, snapshot, __ATOMIC_RELEASE);
+    return 0;
+}
 
 ws_event_target_impl_t* ws_event_target_create(void) {
     ws_event_target_impl_t *target = malloc(sizeof(ws_event_target_impl_t));
     if (!target) return NULL;
 
-    target->listeners = NULL;
+    target->snapshot = ws_event_snapshot_alloc(0, 0);
+    if (!target->snapshot) {
+        free(target);
+        return NULL;
+    }
     pthread_mutex_init(&target->mutex, NULL);
 
     return target;
 }
 
+// No dispatch may be running or start once this is called
 void ws_event_target_destroy(ws_event_target_impl_t *target) {
     if (!target) return;
 
-    pthread_mutex_lock(&target->mutex);
+    // Names are shared by every snapshot; the current one lists them all
+    ws_event_snapshot_t *snapshot = target->snapshot;
+    for (int i = 0; i < snapshot->type_count; i++) {
+        free((char*)snapshot->types[i]);
+    }
 
-    ws_event_listener_t *listener = target->listeners;
-    while (listener) {
-        ws_event_listener_t *next = listener->next;
-        free(listener->event_type);
-        free(listener);
-        listener = next;
+    while (snapshot) {
+        ws_event_snapshot_t *retired = snapshot->retired;
+        free(snapshot);
+        snapshot = retired;
     }
 
-    pthread_mutex_unlock(&target->mutex);
     pthread_mutex_destroy(&target->mutex);
     free(target);
 }
 
-int ws_event_target_add_listener(ws_event_target_impl_t *target, const char *event_type,
-                                 void (*callback)(ws_client_t*, void*), void *user_data) {
-    if (!target || !event_type || !callback) return -1;
+// ID of an event type, registering the name if it is new; -1 on error.
+// IDs are stable for the target's lifetime.
+int ws_event_target_intern(ws_event_target_impl_t *target, const char *event_type) {
+    if (!target || !event_type) return -1;
 
-    ws_event_listener_t *listener = malloc(sizeof(ws_event_listener_t));
-    if (!listener) return -1;
+    pthread_mutex_lock(&target->mutex);
+
+    int type = ws_event_snapshot_find(target->snapshot, event_type);
+    if (type < 0) {
+        char *name = strdup(event_type);
+        if (name && ws_event_target_publish_locked(target, name, -1, NULL) == 0) {
+            type = target->snapshot->type_count - 1;
+        } else {
+            free(name);
+        }
+    }
+
+    pthread_mutex_unlock(&target->mutex);
+    return type;
+}
+
+int ws_event_target_add_listener_id(ws_event_target_impl_t *target, int type,
+                                    void (*callback)(ws_client_t*, void*), void *user_data) {
+    if (!target || !callback) return -1;
 
-    listener->event_type = strdup(event_type);
-    listener->callback = callback;
-    listener->user_data = user_data;
+    ws_event_listener_t listener = { callback, user_data };
 
     pthread_mutex_lock(&target->mutex);
-    listener->next = target->listeners;
-    target->listeners = listener;
+    int result = type >= 0 && type < target->snapshot->type_count ?
+                 ws_event_target_publish_locked(target, NULL, type, &listener) : -1;
     pthread_mutex_unlock(&target->mutex);
 
-    return 0;
-                                 }
+    return result;
+}
 
-                                 void ws_event_target_dispatch(ws_event_target_impl_t *target, const char *event_type,
-                                                               ws_client_t *client, void *data) {
-                                     if (!target || !event_type) return;
+int ws_event_target_add_listener(ws_event_target_impl_t *target, const char *event_type,
+                                 void (*callback)(ws_client_t*, void*), void *user_data) {
+    int type = ws_event_target_intern(target, event_type);
+    if (type < 0) return -1;
 
-                                     pthread_mutex_lock(&target->mutex);
+    return ws_event_target_add_listener_id(target, type, callback, user_data);
+}
 
-                                     ws_event_listener_t *listener = target->listeners;
-                                     while (listener) {
-                                         if (strcmp(listener->event_type, event_type) == 0) {
-                                             listener->callback(client, data);
-                                         }
-                                         listener = listener->next;
-                                     }
+// Run the listeners of an interned type without taking any lock
+void ws_event_target_dispatch_id(ws_event_target_impl_t *target, int type, ws_client_t *client, void *data) {
+    if (!target) return;
 
-                                     pthread_mutex_unlock(&target->mutex);
-                                                               }
+    const ws_event_snapshot_t *snapshot = __atomic_load_n(&target->snapshot, __ATOMIC_ACQUIRE);
+    if (type >= 0 && type < snapshot->type_count) {
+        ws_event_snapshot_run(snapshot, type, client, data);
+    }
+}
+
+// Dispatch by name: finds the ID first, so hot paths should intern once and
+// use ws_event_target_dispatch_id
+void ws_event_target_dispatch(ws_event_target_impl_t *target, const char *event_type,
+                              ws_client_t *client, void *data) {
+    if (!target || !event_type) return;
+
+    const ws_event_snapshot_t *snapshot = __atomic_load_n(&target->snapshot, __ATOMIC_ACQUIRE);
+    int type = ws_event_snapshot_find(snapshot, event_type);
+    if (type >= 0) {
+        ws_event_snapshot_run(snapshot, type, client, data);
+    }
+}
@@ -1,48 +1,191 @@
 #include "websocket.h"
 
-typedef struct ws_extension {
-    char *name;
-    int (*negotiate)(const char *client_extensions, char *server_response);
-    int (*encode)(const uint8_t *input, size_t input_len, uint8_t **output, size_t *output_len);
-    int (*decode)(const uint8_t *input, size_t input_len, uint8_t **output, size_t *output_len);
-    void *context;
-} ws_extension_t;
-
-static ws_extension_t *extensions = NULL;
-static int extension_count = 0;
-
-int ws_extension_register(const char *name,
-                          int (*negotiate)(const char*, char*),
-                          int (*encode)(const uint8_t*, size_t, uint8_t**, size_t*),
-                          int (*decode)(const uint8_t*, size_t, uint8_t**, size_t*)) {
-    extensions = realloc(extensions, (extension_count + 1) * sizeof(ws_extension_t));
-    if (!extensions) return -1;
-
-    ws_extension_t *ext = &extensions[extension_count];
-    ext->name = strdup(name);
-    ext->negotiate = negotiate;
-    ext->encode = encode;
-    ext->decode = decode;
-    ext->context = NULL;
-
-    extension_count++;
+// Register an extension to offer on new connections. Extensions are tried in
+// registration order and applied to outgoing messages in that order.
+int ws_server_add_extension(ws_server_t *server, const ws_extension_t *extension) {
+    if (!server || !extension || server->extension_count >= WS_MAX_EXTENSIONS) return -1;
+
+    server->extensions[server->extension_count++] = extension;
     return 0;
-                          }
+}
+
+// Does this comma-separated offer name the extension?
+static int ws_extension_offer_matches(const char *offer, size_t length, const char *name) {
+    while (length > 0 && (*offer == ' ' || *offer == '\t')) {
+        offer++;
+        length--;
+    }
+
+    size_t name_len = strlen(name);
+    if (length < name_len || strncasecmp(offer, name, name_len) != 0) return 0;
+
+    return length == name_len || offer[name_len] == ';' || offer[name_len] == ' ' || offer[name_len] == '\t';
+}
+
+// Let each registered extension accept at most one of the client's offers.
+// Writes the Sec-WebSocket-Extensions response line (or an empty string) and
+// arms the parser for the RSV bits the accepted extensions claim. If the
+// response does not fit in line, no extension is agreed.
+void ws_extensions_negotiate(ws_client_t *client, char **offers, int offer_count, char *line, size_t line_size) {
+    ws_server_t *server = client->server;
+    char offer[512];
+    char accepted[256];
+    uint8_t claimed = 0;
+    size_t length = 0;
+    int truncated = 0;
+
+    line[0] = '\0';
+
+    for (int e = 0; e < server->extension_count; e++) {
+        const ws_extension_t *extension = server->extensions[e];
+        int done = 0;
+
+        // Two extensions cannot share an RSV bit on one connection
+        if (extension->rsv & claimed) continue;
+
+        for (int i = 0; i < offer_count && !done; i++) {
+            const char *p = offers[i];
+            const char *end = p + strlen(p);
+
+            while (p < end && !done) {
+                const char *offer_end = memchr(p, ',', end - p);
+                if (!offer_end) offer_end = end;
+
+                size_t offer_len = offer_end - p;
+                if (offer_len < sizeof(offer) && ws_extension_offer_matches(p, offer_len, extension->name)) {
+                    void *context = NULL;
+
+                    memcpy(offer, p, offer_len);
+                    offer[offer_len] = '\0';
+
+                    if (extension->negotiate(client, offer, accepted, sizeof(accepted), &context)) {
+                        ws_extension_slot_t *slot = &client->extensions[client->extension_count++];
+                        slot->extension = extension;
+                        slot->context = context;
+                        claimed |= extension->rsv;
+
+                        length += snprintf(line + length, line_size - length, "%s%s",
+                                           length ? ", " : "Sec-WebSocket-Extensions: ", accepted);
+                        if (length >= line_size) {
+                            length = line_size - 1;
+                            truncated = 1;
+                        }
+                        done = 1;
+                    }
+                }
+
+                p = offer_end + 1;
+            }
+        }
+    }
+
+    if (length > 0 && length + 2 < line_size && !truncated) {
+        memcpy(line + length, "\r\n", 3);
+    } else if (length > 0) {
+        // The peer would not learn what was agreed, so agree to nothing
+        line[0] = '\0';
+        claimed = 0;
+
+        pthread_mutex_lock(&client->mutex);
+        ws_extensions_destroy_locked(client);
+        client->deflate.enabled = 0;
+        pthread_mutex_unlock(&client->mutex);
+    }
+
+    client->parser.allowed_rsv = claimed;
+}
+
+// Run an outgoing data message through the connection's extensions.
+// Returns 1 with *output set (release with ws_pool_free) and the RSV bits to
+// add in *rsv, 0 when no extension changed it, -1 on error.
+// Caller must hold client->mutex.
+int ws_extensions_encode_locked(ws_client_t *client, ws_opcode_t opcode, const uint8_t *payload, size_t length,
+                                uint8_t **output, size_t *output_len, uint8_t *rsv) {
+    uint8_t *current = NULL;
+
+    *rsv = 0;
+
+    for (int i = 0; i < client->extension_count; i++) {
+        ws_extension_slot_t *slot = &client->extensions[i];
+        uint8_t *encoded;
+        size_t encoded_len;
+
+        int result = slot->extension->encode(slot->context, opcode, current ? current : payload,
+                                             current ? *output_len : length, &encoded, &encoded_len);
+        if (result < 0) {
+            ws_pool_free(current);
+            return -1;
+        }
+
+        if (result > 0) {
+            ws_pool_free(current);
+            current = encoded;
+            *output_len = encoded_len;
+            *rsv |= slot->extension->rsv;
+        }
+    }
+
+    *output = current;
+    return current != NULL;
+}
+
+// Undo the extensions flagged (rsv) on a received message, last applied first.
+// Returns 1 with *output set (release with ws_pool_free), 0 when no extension
+// changed it, -1 with *error set to a close code.
+int ws_extensions_decode(ws_client_t *client, uint8_t rsv, const uint8_t *input, size_t input_len,
+                         uint8_t **output, size_t *output_len, uint16_t *error) {
+    uint8_t *current = NULL;
+    size_t current_len = input_len;
+
+    for (int i = client->extension_count - 1; i >= 0; i--) {
+        ws_extension_slot_t *slot = &client->extensions[i];
+        if (!(slot->extension->rsv & rsv)) continue;
+
+        uint8_t *decoded;
+        size_t decoded_len;
+        int result = slot->extension->decode(slot->context, current ? current : input, current_len,
+                                             client->server->max_message_size, &decoded, &decoded_len, error);
+        if (result < 0) {
+            ws_pool_free(current);
+            return -1;
+        }
+        if (result == 0) continue;
+
+        ws_pool_free(current);
+        current = decoded;
+        current_len = decoded_len;
+    }
+
+    *output = current;
+    *output_len = current_len;
+    return current != NULL;
+}
+
+// The extension that can decode a message with these RSV bits frame by
+// frame, or NULL if it must be collected and decoded whole
+const ws_extension_slot_t* ws_extensions_stream_decoder(ws_client_t *client, uint8_t rsv) {
+    const ws_extension_slot_t *found = NULL;
+
+    for (int i = 0; i < client->extension_count; i++) {
+        const ws_extension_slot_t *slot = &client->extensions[i];
+        if (!(slot->extension->rsv & rsv)) continue;
 
-                          int ws_extension_negotiate(const char *client_extensions, char *server_response) {
-                              if (!client_extensions || !server_response) return -1;
+        // Chained decoders would need every stage to stream
+        if (found || !slot->extension->decode_stream) return NULL;
+        found = slot;
+    }
 
-                              server_response[0] = '\0';
+    return found;
+}
 
-                              for (int i = 0; i < extension_count; i++) {
-                                  if (strstr(client_extensions, extensions[i].name)) {
-                                      if (extensions[i].negotiate) {
-                                          if (extensions[i].negotiate(client_extensions, server_response) == 0) {
-                                              return 0; // Extension negotiated
-                                          }
-                                      }
-                                  }
-                              }
+// Caller must hold client->mutex
+void ws_extensions_destroy_locked(ws_client_t *client) {
+    for (int i = 0; i < client->extension_count; i++) {
+        ws_extension_slot_t *slot = &client->extensions[i];
+        if (slot->extension->destroy) {
+            slot->extension->destroy(slot->context);
+        }
+    }
 
-                              return -1; // No extensions negotiated
-                          }
+    client->extension_count = 0;
+}
@@ -0,0 +1,304 @@
+#include "websocket.h"
+
+// HTTP/1.1 upgrade request parsing (RFC 6455 section 4.2.1)
+//
+// The parser is fed the accumulated request after every read and resumes at
+// the first unscanned byte, so a request split across any number of packets
+// costs one pass over its bytes. Header values are recorded as offsets into
+// the caller's buffer; nothing is copied or allocated.
+
+enum {
+    WS_HTTP_REQUEST_LINE = 0,
+    WS_HTTP_HEADERS,
+    WS_HTTP_DONE,
+    WS_HTTP_ERROR
+};
+
+// Required headers, in ws_http_parser_t.seen
+#define WS_HTTP_HAVE_HOST       0x01
+#define WS_HTTP_HAVE_UPGRADE    0x02
+#define WS_HTTP_HAVE_CONNECTION 0x04
+#define WS_HTTP_HAVE_VERSION    0x08
+#define WS_HTTP_HAVE_KEY        0x10
+#define WS_HTTP_HAVE_ALL        0x1f
+
+void ws_http_parser_init(ws_http_parser_t *parser) {
+    memset(parser, 0, sizeof(*parser));
+}
+
+static int ws_http_fail(ws_http_parser_t *parser, uint16_t status) {
+    parser->status = status;
+    parser->state = WS_HTTP_ERROR;
+    return -1;
+}
+
+static int ws_http_name_equals(const char *name, size_t length, const char *expected) {
+    return strlen(expected) == length && strncasecmp(name, expected, length) == 0;
+}
+
+// Is token one of the comma-separated elements of value? (case-insensitive)
+static int ws_http_list_contains(const char *value, size_t length, const char *token) {
+    size_t token_len = strlen(token);
+    const char *end = value + length;
+
+    while (value < end) {
+        const char *element_end = memchr(value, ',', end - value);
+        if (!element_end) element_end = end;
+
+        const char *first = value;
+        const char *last = element_end;
+        while (first < last && (*first == ' ' || *first == '\t')) first++;
+        while (last > first && (last[-1] == ' ' || last[-1] == '\t')) last--;
+
+        if ((size_t)(last - first) == token_len && strncasecmp(first, token, token_len) == 0) return 1;
+
+        value = element_end + 1;
+    }
+
+    return 0;
+}
+
+// The key must be a base64-encoded 16-byte nonce
+static int ws_http_valid_key(const char *key, size_t length) {
+    uint8_t nonce[18];
+    size_t nonce_len = sizeof(nonce);
+
+    return ws_base64_decode(key, length, nonce, &nonce_len) == 0 && nonce_len == 16;
+}
+
+// "GET <target> HTTP/1.1"; any later 1.x minor version is accepted too
+static int ws_http_request_line(ws_http_parser_t *parser, const char *line, size_t length) {
+    if (length < 14 || memcmp(line, "GET ", 4) != 0) return ws_http_fail(parser, 400);
+
+    const char *target = line + 4;
+    const char *target_end = memchr(target, ' ', length - 4);
+    if (!target_end || target_end == target) return ws_http_fail(parser, 400);
+
+    const char *version = target_end + 1;
+    size_t version_len = line + length - version;
+    if (version_len != 8 || memcmp(version, "HTTP/1.", 7) != 0 || version[7] < '1' || version[7] > '9') {
+        return ws_http_fail(parser, 400);
+    }
+
+    parser->state = WS_HTTP_HEADERS;
+    return 0;
+}
+
+static int ws_http_header(ws_http_parser_t *parser, const char *data, size_t start, size_t length) {
+    const char *line = data + start;
+
+    // Obsolete line folding is not worth supporting for an upgrade request
+    if (line[0] == ' ' || line[0] == '\t') return ws_http_fail(parser, 400);
+
+    const char *colon = memchr(line, ':', length);
+    if (!colon || colon == line) return ws_http_fail(parser, 400);
+
+    // No whitespace is allowed between the name and the colon
+    size_t name_len = colon - line;
+    if (colon[-1] == ' ' || colon[-1] == '\t') return ws_http_fail(parser, 400);
+
+    const char *value = colon + 1;
+    const char *value_end = line + length;
+    while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+    size_t value_len = value_end - value;
+
+    if (ws_http_name_equals(line, name_len, "Host")) {
+        if (parser->seen & WS_HTTP_HAVE_HOST || value_len == 0) return ws_http_fail(parser, 400);
+        parser->seen |= WS_HTTP_HAVE_HOST;
+    } else if (ws_http_name_equals(line, name_len, "Upgrade")) {
+        if (ws_http_list_contains(value, value_len, "websocket")) parser->seen |= WS_HTTP_HAVE_UPGRADE;
+    } else if (ws_http_name_equals(line, name_len, "Connection")) {
+        if (ws_http_list_contains(value, value_len, "Upgrade")) parser->seen |= WS_HTTP_HAVE_CONNECTION;
+    } else if (ws_http_name_equals(line, name_len, "Sec-WebSocket-Version")) {
+        // Tell the client which version we speak (section 4.4)
+        if (parser->seen & WS_HTTP_HAVE_VERSION || value_len != 2 || memcmp(value, "13", 2) != 0) {
+            return ws_http_fail(parser, 426);
+        }
+        parser->seen |= WS_HTTP_HAVE_VERSION;
+    } else if (ws_http_name_equals(line, name_len, "Sec-WebSocket-Key")) {
+        if (parser->seen & WS_HTTP_HAVE_KEY || !ws_http_valid_key(value, value_len)) return ws_http_fail(parser, 400);
+        parser->key.offset = value - data;
+        parser->key.length = value_len;
+        parser->seen |= WS_HTTP_HAVE_KEY;
+    } else if (ws_http_name_equals(line, name_len, "Sec-WebSocket-Extensions")) {
+        if (parser->offer_count < WS_HTTP_MAX_OFFERS) {
+            parser->offers[parser->offer_count].offset = value - data;
+            parser->offers[parser->offer_count].length = value_len;
+            parser->offer_count++;
+        }
+    }
+
+    return 0;
+}
+
+// Scan the bytes added since the last call. data holds the whole request so
+// far and must not move between calls. Returns 1 once a valid request is
+// complete (request_length says where it ends), 0 if more bytes are needed,
+// -1 if the request is rejected (status holds the HTTP status to send).
+int ws_http_parser_feed(ws_http_parser_t *parser, const char *data, size_t length) {
+    if (parser->state == WS_HTTP_DONE) return 1;
+    if (parser->state == WS_HTTP_ERROR) return -1;
+
+    while (parser->scanned < length) {
+        const char *newline = memchr(data + parser->scanned, '\n', length - parser->scanned);
+        if (!newline) {
+            parser->scanned = length > WS_HANDSHAKE_SIZE ? WS_HANDSHAKE_SIZE : length;
+            break;
+        }
+
+        size_t end = newline - data;
+        if (end >= WS_HANDSHAKE_SIZE) break;
+
+        size_t start = parser->line_start;
+        size_t line_len = end - start;
+        if (line_len > 0 && data[end - 1] == '\r') line_len--;
+
+        parser->scanned = end + 1;
+        parser->line_start = end + 1;
+
+        if (parser->state == WS_HTTP_REQUEST_LINE) {
+            if (ws_http_request_line(parser, data + start, line_len) < 0) return -1;
+        } else if (line_len == 0) {
+            // Blank line: the request is complete
+            if ((parser->seen & WS_HTTP_HAVE_ALL) != WS_HTTP_HAVE_ALL) {
+                return ws_http_fail(parser, parser->seen & WS_HTTP_HAVE_VERSION ? 400 : 426);
+            }
+            parser->request_length = end + 1;
+            parser->state = WS_HTTP_DONE;
+            return 1;
+        } else if (ws_http_header(parser, data, start, line_len) < 0) {
+            return -1;
+        }
+    }
+
+    if (length >= WS_HANDSHAKE_SIZE) return ws_http_fail(parser, 431);
+    return 0;
+}
+
+// Build the 101 response for a request the parser accepted. Header values
+// in request are NUL-terminated in place. Returns the length or -1.
+int ws_handshake_accept(ws_client_t *client, const ws_http_parser_t *parser, char *request,
+                        char *response, size_t response_size) {
+    char *offers[WS_HTTP_MAX_OFFERS];
+    char accept_key[WS_ACCEPT_KEY_SIZE];
+    char extensions[300];
+
+    // Every span ends before the line's CR or LF, so terminating it is safe
+    char *key = request + parser->key.offset;
+    key[parser->key.length] = '\0';
+
+    for (int i = 0; i < parser->offer_count; i++) {
+        offers[i] = request + parser->offers[i].offset;
+        offers[i][parser->offers[i].length] = '\0';
+    }
+
+    ws_generate_accept_key(key, accept_key);
+
+    extensions[0] = '\0';
+    if (client) {
+        ws_extensions_negotiate(client, offers, parser->offer_count, extensions, sizeof(extensions));
+    }
+
+    int length = snprintf(response, response_size,
+                          "HTTP/1.1 101 Switching Protocols\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Accept: %s\r\n"
+                          "%s\r\n",
+                          accept_key, extensions);
+
+    if (length < 0 || (size_t)length >= response_size) return -1;
+    return length;
+}
+
+// Format the error response for a rejected upgrade; returns its length
+int ws_handshake_reject(uint16_t status, char *response, size_t response_size) {
+    const char *reason = status == 426 ? "Upgrade Required" :
+                         status == 431 ? "Request Header Fields Too Large" : "Bad Request";
+
+    int length = snprintf(response, response_size,
+                          "HTTP/1.1 %u %s\r\n"
+                          "%s"
+                          "Connection: close\r\n"
+                          "Content-Length: 0\r\n"
+                          "\r\n",
+                          status ? status : 400, reason,
+                          status == 426 ? "Sec-WebSocket-Version: 13\r\n" : "");
+
+    if (length < 0 || (size_t)length >= response_size) return -1;
+    return length;
+}
+
+// Build the 101 response for a complete, NUL-terminated upgrade request.
+// The request buffer is modified. Returns the response length or -1.
+int ws_handshake_response(ws_client_t *client, char *request, char *response, size_t response_size) {
+    ws_http_parser_t parser;
+
+    ws_http_parser_init(&parser);
+    if (ws_http_parser_feed(&parser, request, strlen(request)) != 1) return -1;
+
+    return ws_handshake_accept(client, &parser, request, response, response_size);
+}
+
+// Blocking handshake for the threaded model. Reads until the request is
+// complete, waiting no longer than the server's handshake timeout in total.
+// Bytes that followed the request are moved to the front of buffer.
+// Returns their count, or -1 if the connection must be dropped.
+int ws_handshake_read(ws_client_t *client, char *buffer, size_t size) {
+    ws_http_parser_t *parser = &client->handshake;
+    int timeout = client->server ? client->server->handshake_timeout_ms : 0;
+    uint64_t deadline = timeout > 0 ? ws_monotonic_ms() + timeout : 0;
+    char response[1024];
+    size_t received = 0;
+    int result = 0;
+
+    ws_http_parser_init(parser);
+
+    while (result == 0) {
+        if (received == size) return -1;
+
+        if (deadline) {
+            uint64_t now = ws_monotonic_ms();
+            struct pollfd pfd;
+
+            if (now >= deadline) return -1;
+
+            pfd.fd = client->socket;
+            pfd.events = POLLIN;
+            int ready = poll(&pfd, 1, (int)(deadline - now));
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return -1;
+        }
+
+        ssize_t bytes = recv(client->socket, buffer + received, size - received, 0);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return -1;
+
+        received += bytes;
+        result = ws_http_parser_feed(parser, buffer, received);
+    }
+
+    if (result < 0) {
+        int length = ws_handshake_reject(parser->status, response, sizeof(response));
+        if (length > 0) {
+            send(client->socket, response, length, MSG_NOSIGNAL);
+        }
+        return -1;
+    }
+
+    int response_len = ws_handshake_accept(client, parser, buffer, response, sizeof(response));
+    if (response_len < 0 || send(client->socket, response, response_len, MSG_NOSIGNAL) != response_len) {
+        return -1;
+    }
+
+    size_t leftover = received - parser->request_length;
+    memmove(buffer, buffer + parser->request_length, leftover);
+    return (int)leftover;
+}
+
+int ws_handshake(ws_client_t *client) {
+    char buffer[WS_HANDSHAKE_SIZE];
+
+    return ws_handshake_read(client, buffer, sizeof(buffer)) < 0 ? -1 : 0;
+}
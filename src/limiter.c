@@ -1,13 +1,262 @@
 #include "websocket.h"
 
+// Receive rate limiting
+//
+// Each limit is a token bucket kept as a single timestamp (the generic cell
+// rate algorithm): full_at is when the bucket will be full again, taking
+// tokens pushes it later, and a bucket whose full_at lies more than burst_ns
+// ahead is in debt. One compare-and-swap updates it, so the per-address and
+// server buckets are shared between threads without locks. Received bytes
+// and frames are charged after the fact, and a connection in debt on any
+// tier is simply not read from until it has paid it off; its data waits in
+// the kernel and TCP flow control slows the sender down.
+
+#define WS_NS_PER_SEC 1000000000ULL
+
+// Time the bucket takes to earn this many tokens
+static uint64_t ws_token_bucket_cost(const ws_token_bucket_t *bucket, uint64_t tokens) {
+    return tokens / bucket->amount * bucket->period_ns + tokens % bucket->amount * bucket->period_ns / bucket->amount;
+}
+
+// Earn amount tokens every period_ns, holding at most capacity; starts full
+void ws_token_bucket_init(ws_token_bucket_t *bucket, uint64_t amount, uint64_t period_ns, uint64_t capacity) {
+    bucket->amount = amount;
+    bucket->period_ns = period_ns;
+    bucket->burst_ns = amount ? ws_token_bucket_cost(bucket, capacity) : 0;
+    bucket->full_at = 0;
+}
+
+// Take tokens if the bucket holds them. Returns 1 if it did, 0 if not.
+int ws_token_bucket_take(ws_token_bucket_t *bucket, uint64_t tokens, uint64_t now_ns) {
+    if (!bucket->amount) return 1;
+
+    uint64_t cost = ws_token_bucket_cost(bucket, tokens);
+    uint64_t full_at = __atomic_load_n(&bucket->full_at, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        next = (full_at > now_ns ? full_at : now_ns) + cost;
+        if (next > now_ns + bucket->burst_ns) return 0;
+    } while (!__atomic_compare_exchange_n(&bucket->full_at, &full_at, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 1;
+}
+
+// Take tokens whether or not the bucket holds them, going into debt
+void ws_token_bucket_charge(ws_token_bucket_t *bucket, uint64_t tokens, uint64_t now_ns) {
+    if (!bucket->amount || !tokens) return;
+
+    uint64_t cost = ws_token_bucket_cost(bucket, tokens);
+    uint64_t full_at = __atomic_load_n(&bucket->full_at, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        next = (full_at > now_ns ? full_at : now_ns) + cost;
+    } while (!__atomic_compare_exchange_n(&bucket->full_at, &full_at, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Nanoseconds until the bucket is out of debt, 0 if it is not in debt
+uint64_t ws_token_bucket_wait(const ws_token_bucket_t *bucket, uint64_t now_ns) {
+    uint64_t full_at = __atomic_load_n(&bucket->full_at, __ATOMIC_RELAXED);
+    uint64_t limit = now_ns + bucket->burst_ns;
+
+    return full_at > limit ? full_at - limit : 0;
+}
+
+static void ws_rate_limit_init(ws_rate_limit_t *limit, int messages_per_sec, int bytes_per_sec, int burst_ms) {
+    uint64_t messages = messages_per_sec > 0 ? (uint64_t)messages_per_sec : 0;
+    uint64_t bytes = bytes_per_sec > 0 ? (uint64_t)bytes_per_sec : 0;
+    uint64_t message_capacity = messages * burst_ms / 1000;
+    uint64_t byte_capacity = bytes * burst_ms / 1000;
+
+    ws_token_bucket_init(&limit->messages, messages, WS_NS_PER_SEC, message_capacity ? message_capacity : 1);
+    ws_token_bucket_init(&limit->bytes, bytes, WS_NS_PER_SEC, byte_capacity ? byte_capacity : 1);
+}
+
+static void ws_rate_limit_charge(ws_rate_limit_t *limit, unsigned messages, size_t bytes, uint64_t now_ns) {
+    ws_token_bucket_charge(&limit->messages, messages, now_ns);
+    ws_token_bucket_charge(&limit->bytes, bytes, now_ns);
+}
+
+static uint64_t ws_rate_limit_wait(const ws_rate_limit_t *limit, uint64_t now_ns) {
+    uint64_t messages = ws_token_bucket_wait(&limit->messages, now_ns);
+    uint64_t bytes = ws_token_bucket_wait(&limit->bytes, now_ns);
+
+    return messages > bytes ? messages : bytes;
+}
+
+// Neither bucket is in debt or partly drained, so forgetting it loses nothing
+static int ws_rate_limit_full(const ws_rate_limit_t *limit, uint64_t now_ns) {
+    return __atomic_load_n(&limit->messages.full_at, __ATOMIC_RELAXED) <= now_ns &&
+           __atomic_load_n(&limit->bytes.full_at, __ATOMIC_RELAXED) <= now_ns;
+}
+
+int ws_server_limits_init(ws_server_t *server, const ws_server_config_t *config) {
+    int burst_ms = config->rate_limit_burst_ms > 0 ? config->rate_limit_burst_ms : WS_DEFAULT_RATE_BURST;
+
+    ws_rate_limit_init(&server->connection_limit, config->connection_messages_per_sec,
+                       config->connection_bytes_per_sec, burst_ms);
+    ws_rate_limit_init(&server->server_limit, config->server_messages_per_sec,
+                       config->server_bytes_per_sec, burst_ms);
+    server->address_limits = NULL;
+    server->rate_limited = config->connection_messages_per_sec > 0 || config->connection_bytes_per_sec > 0 ||
+                           config->server_messages_per_sec > 0 || config->server_bytes_per_sec > 0;
+
+    if (config->address_messages_per_sec <= 0 && config->address_bytes_per_sec <= 0) return 0;
+
+    ws_address_table_t *table = calloc(1, sizeof(ws_address_table_t));
+    if (!table) return -1;
+
+    for (int i = 0; i < WS_ADDRESS_SHARDS; i++) {
+        pthread_mutex_init(&table->shards[i].mutex, NULL);
+    }
+    ws_rate_limit_init(&table->initial, config->address_messages_per_sec, config->address_bytes_per_sec, burst_ms);
+
+    server->address_limits = table;
+    server->rate_limited = 1;
+    return 0;
+}
+
+void ws_server_limits_destroy(ws_server_t *server) {
+    ws_address_table_t *table = server->address_limits;
+    if (!table) return;
+
+    for (int i = 0; i < WS_ADDRESS_SHARDS; i++) {
+        for (int c = 0; c < WS_ADDRESS_CHAINS; c++) {
+            ws_address_limit_t *entry = table->shards[i].chains[c];
+            while (entry) {
+                ws_address_limit_t *next = entry->next;
+                free(entry);
+                entry = next;
+            }
+        }
+        pthread_mutex_destroy(&table->shards[i].mutex);
+    }
+
+    free(table);
+    server->address_limits = NULL;
+}
+
+// Fibonacci hashing: the top bits pick the shard, the next ones the chain
+static uint32_t ws_address_hash(in_addr_t address) {
+    return (uint32_t)ntohl(address) * 2654435769u;
+}
+
+// Give the connection its budgets. Called once the handshake is done.
+void ws_client_limits_attach(ws_client_t *client) {
+    ws_server_t *server = client->server;
+    ws_address_table_t *table = server->address_limits;
+
+    client->limit = server->connection_limit;
+    client->address_limit = NULL;
+    client->throttled_until = 0;
+
+    if (!table) return;
+
+    in_addr_t address = client->address.sin_addr.s_addr;
+    uint32_t hash = ws_address_hash(address);
+    uint64_t now = ws_monotonic_ns();
+    ws_address_shard_t *shard = &table->shards[hash >> 26];
+    ws_address_limit_t **link = &shard->chains[(hash >> 16) & (WS_ADDRESS_CHAINS - 1)];
+    ws_address_limit_t *found = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    // Entries outlive their last connection until their buckets refill, so
+    // reconnecting does not reset an address's budget; sweep those here
+    while (*link) {
+        ws_address_limit_t *entry = *link;
+
+        if (entry->address == address) {
+            found = entry;
+        } else if (entry->connections == 0 && ws_rate_limit_full(&entry->limit, now)) {
+            *link = entry->next;
+            free(entry);
+            continue;
+        }
+        link = &entry->next;
+    }
+
+    if (!found) {
+        found = malloc(sizeof(ws_address_limit_t));
+        if (found) {
+            found->next = NULL;
+            found->address = address;
+            found->connections = 0;
+            found->limit = table->initial;
+            *link = found;
+        }
+    }
+
+    // Without memory for an entry the address goes unlimited
+    if (found) {
+        found->connections++;
+        client->address_limit = found;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void ws_client_limits_detach(ws_client_t *client) {
+    ws_address_limit_t *entry = client->address_limit;
+    if (!entry) return;
+
+    ws_address_table_t *table = client->server->address_limits;
+    uint32_t hash = ws_address_hash(entry->address);
+    ws_address_shard_t *shard = &table->shards[hash >> 26];
+
+    pthread_mutex_lock(&shard->mutex);
+    entry->connections--;
+    pthread_mutex_unlock(&shard->mutex);
+
+    client->address_limit = NULL;
+}
+
+// Nanoseconds until every tier the connection draws on is out of debt
+static uint64_t ws_client_limits_debt(ws_client_t *client, uint64_t now) {
+    uint64_t wait = ws_rate_limit_wait(&client->limit, now);
+
+    if (client->address_limit) {
+        uint64_t address = ws_rate_limit_wait(&client->address_limit->limit, now);
+        if (address > wait) wait = address;
+    }
+
+    uint64_t global = ws_rate_limit_wait(&client->server->server_limit, now);
+    return global > wait ? global : wait;
+}
+
+// Account for received messages and bytes. Returns 1 if the connection is
+// now over a limit and should not be read from for a while.
+int ws_client_limits_charge(ws_client_t *client, unsigned messages, size_t bytes) {
+    ws_server_t *server = client->server;
+    if (!server->rate_limited) return 0;
+
+    uint64_t now = ws_monotonic_ns();
+
+    ws_rate_limit_charge(&client->limit, messages, bytes, now);
+    if (client->address_limit) {
+        ws_rate_limit_charge(&client->address_limit->limit, messages, bytes, now);
+    }
+    ws_rate_limit_charge(&server->server_limit, messages, bytes, now);
+
+    return ws_client_limits_debt(client, now) > 0;
+}
+
+// Milliseconds before the connection may be read from again, 0 for now
+int ws_client_limits_wait(ws_client_t *client) {
+    if (!client->server->rate_limited || client->state != WS_STATE_OPEN) return 0;
+
+    uint64_t wait = (ws_client_limits_debt(client, ws_monotonic_ns()) + 999999) / 1000000;
+    return wait > INT_MAX ? INT_MAX : (int)wait;
+}
+
 ws_rate_limiter_t* ws_rate_limiter_create(int max_requests, int window_seconds) {
+    if (max_requests <= 0 || window_seconds <= 0) return NULL;
+
     ws_rate_limiter_t *limiter = malloc(sizeof(ws_rate_limiter_t));
     if (!limiter) return NULL;
 
-    limiter->max_requests = max_requests;
-    limiter->window_seconds = window_seconds;
-    limiter->count = 0;
-    limiter->last_reset = time(NULL);
+    ws_token_bucket_init(&limiter->bucket, max_requests, (uint64_t)window_seconds * WS_NS_PER_SEC, max_requests);
 
     return limiter;
 }
@@ -21,19 +270,5 @@ void ws_rate_limiter_destroy(ws_rate_limiter_t *limiter) {
 int ws_rate_limiter_check(ws_rate_limiter_t *limiter) {
     if (!limiter) return 1; // No limiter, allow
 
-    time_t now = time(NULL);
-
-    // Reset counter if window has passed
-    if (now - limiter->last_reset >= limiter->window_seconds) {
-        limiter->count = 0;
-        limiter->last_reset = now;
-    }
-
-    // Check if limit exceeded
-    if (limiter->count >= limiter->max_requests) {
-        return 0; // Rate limit exceeded
-    }
-
-    limiter->count++;
-    return 1; // Allow request
+    return ws_token_bucket_take(&limiter->bucket, 1, ws_monotonic_ns());
 }
@@ -6,7 +6,7 @@ void on_connection(ws_client_t *client) {
            ntohs(client->address.sin_port));
 
     // Send welcome message
-    ws_send_text(client->socket, "Welcome to WebSocket server!");
+    ws_client_send_text(client, "Welcome to WebSocket server!");
 }
 
 void on_message(ws_client_t *client, const char *message, size_t length, ws_opcode_t opcode) {
@@ -15,15 +15,39 @@ void on_message(ws_client_t *client, const char *message, size_t length, ws_opco
     if (opcode == WS_TEXT) {
         printf("TEXT: %.*s\n", (int)length, message);
 
+        // "/all <text>" is relayed to every connected client
+        if (length > 5 && strncmp(message, "/all ", 5) == 0) {
+            ws_server_broadcast(client->server, WS_TEXT, (const uint8_t*)message + 5, length - 5, NULL);
+            return;
+        }
+
+        // Rooms: "/join <room>", "/leave <room>", "/to <room> <text>"
+        char line[1024], room[128];
+        int offset = 0;
+        snprintf(line, sizeof(line), "%.*s", (int)length, message);
+
+        if (sscanf(line, "/join %127s", room) == 1) {
+            ws_client_send_text(client, ws_server_subscribe(client, room) == 0 ? "joined" : "join failed");
+            return;
+        }
+        if (sscanf(line, "/leave %127s", room) == 1) {
+            ws_client_send_text(client, ws_server_unsubscribe(client, room) == 0 ? "left" : "not joined");
+            return;
+        }
+        if (sscanf(line, "/to %127s %n", room, &offset) == 1 && offset > 0) {
+            ws_server_publish(client->server, room, WS_TEXT, (const uint8_t*)line + offset, strlen(line + offset));
+            return;
+        }
+
         // Echo the message back
         char response[1024];
         snprintf(response, sizeof(response), "Echo: %.*s", (int)length, message);
-        ws_send_text(client->socket, response);
+        ws_client_send_text(client, response);
     } else if (opcode == WS_BINARY) {
         printf("BINARY: %zu bytes\n", length);
 
         // Echo binary data back
-        ws_send_binary(client->socket, (uint8_t*)message, length);
+        ws_client_send_binary(client, (uint8_t*)message, length);
     }
 }
 
@@ -41,14 +65,35 @@ void on_error(ws_client_t *client, const char *error) {
 }
 
 int main(int argc, char *argv[]) {
-    int port = 8080;
+    ws_server_config_t config;
+    ws_server_config_init(&config);
 
     if (argc > 1) {
-        port = atoi(argv[1]);
+        config.port = atoi(argv[1]);
+    }
+
+    // Optional I/O model: "threaded" (default) or "epoll [workers]"
+    if (argc > 2 && strcmp(argv[2], "epoll") == 0) {
+        config.mode = WS_MODE_EPOLL;
+        config.max_clients = 10000;
+        if (argc > 3) {
+            config.workers = atoi(argv[3]);
+        }
     }
 
+    // Compress larger messages for clients that offer permessage-deflate
+    config.permessage_deflate = 1;
+
+    // Ping quiet clients so dead peers are noticed
+    config.ping_interval_ms = 30000;
+
+    // Gather the replies to one read into one write
+    config.cork = 1;
+
+    int port = config.port;
+
     // Create WebSocket server
-    ws_server_t *server = ws_server_create(port);
+    ws_server_t *server = ws_server_create_ex(&config);
     if (!server) {
         fprintf(stderr, "Failed to create WebSocket server\n");
         return 1;
@@ -0,0 +1,194 @@
+#include "websocket.h"
+
+// Data message assembly (RFC 6455 section 5.4)
+//
+// A message is a TEXT or BINARY frame followed by CONTINUATION frames until
+// one has FIN set. Control frames may arrive between them; the caller handles
+// those and passes only data frames here. With on_message_chunk, each frame's
+// payload is handed over as it arrives (decompressed frame by frame when the
+// extension can), so a large upload never sits in memory whole. Otherwise
+// fragments are collected in a per-connection ws_buffer_t and delivered once.
+
+// Reassembly buffers larger than this are freed after the message
+#define WS_MESSAGE_BUFFER_KEEP 65536
+
+typedef struct {
+    ws_client_t *client;
+    ws_opcode_t opcode;
+    uint16_t error;             // Close code when delivery was refused
+} ws_message_sink_t;
+
+static void ws_message_fail(ws_client_t *client, uint16_t code, const char *reason) {
+    ws_client_emit_error(client, reason);
+    ws_client_send_close(client, code, reason);
+    ws_client_message_reset(client);
+}
+
+static const char* ws_message_reason(uint16_t code) {
+    return code == 1009 ? "Message too big" : code == 1007 ? "Invalid UTF-8" : "Invalid extension data";
+}
+
+// Forget the current message; the buffer is kept for the next one while small
+static void ws_message_done(ws_client_t *client) {
+    client->message_opcode = WS_CONTINUATION;
+    client->message_rsv = 0;
+    client->message_length = 0;
+
+    if (client->message) {
+        if (client->message->capacity > WS_MESSAGE_BUFFER_KEEP) {
+            ws_buffer_destroy(client->message);
+            client->message = NULL;
+        } else {
+            ws_buffer_clear(client->message);
+        }
+    }
+}
+
+void ws_client_message_reset(ws_client_t *client) {
+    ws_message_done(client);
+    ws_buffer_destroy(client->message);
+    client->message = NULL;
+}
+
+// Validate (TEXT) and hand one piece of a streamed message to the application
+static int ws_message_sink(void *ctx, const uint8_t *data, size_t length) {
+    ws_message_sink_t *sink = (ws_message_sink_t*)ctx;
+    ws_client_t *client = sink->client;
+    ws_event_target_t *target = client->server->event_target;
+
+    if (sink->opcode == WS_TEXT && !ws_utf8_validate_chunk(&client->message_utf8, data, length)) {
+        sink->error = 1007;
+        return -1;
+    }
+
+    target->on_message_chunk(client, (const char*)data, length, sink->opcode, 0);
+    return 0;
+}
+
+// Streaming delivery: pass this frame's payload on now. Returns -1 after
+// queuing a close.
+static int ws_message_stream(ws_client_t *client, const ws_frame_t *frame) {
+    ws_event_target_t *target = client->server->event_target;
+    ws_message_sink_t sink = { client, client->message_opcode, 0 };
+    int final = frame->fin;
+
+    if (client->message_rsv) {
+        const ws_extension_slot_t *slot = ws_extensions_stream_decoder(client, client->message_rsv);
+        uint16_t error = 1011;
+
+        if (slot->extension->decode_stream(slot->context, frame->payload, frame->payload_length, final,
+                                           client->server->max_message_size, ws_message_sink, &sink,
+                                           &error) < 0) {
+            if (sink.error) error = sink.error;
+            ws_message_fail(client, error, ws_message_reason(error));
+            return -1;
+        }
+
+        if (!final) return 0;
+
+        // Output was delivered as it was inflated; only the end is left
+        if (sink.opcode == WS_TEXT && !ws_utf8_finish(&client->message_utf8)) {
+            ws_message_fail(client, 1007, "Invalid UTF-8");
+            return -1;
+        }
+        target->on_message_chunk(client, "", 0, sink.opcode, 1);
+        return 0;
+    }
+
+    if (sink.opcode == WS_TEXT &&
+        (!ws_utf8_validate_chunk(&client->message_utf8, frame->payload, frame->payload_length) ||
+         (final && !ws_utf8_finish(&client->message_utf8)))) {
+        ws_message_fail(client, 1007, "Invalid UTF-8");
+        return -1;
+    }
+
+    target->on_message_chunk(client, (const char*)frame->payload, frame->payload_length, sink.opcode, final);
+    return 0;
+}
+
+// Deliver a complete message, decoding it first if an extension flagged it
+static void ws_message_deliver(ws_client_t *client, const uint8_t *payload, size_t length) {
+    ws_event_target_t *target = client->server->event_target;
+    ws_opcode_t opcode = client->message_opcode;
+    uint8_t *decoded = NULL;
+
+    if (client->message_rsv) {
+        uint16_t error = 1011;
+
+        if (ws_extensions_decode(client, client->message_rsv, payload, length, &decoded, &length, &error) < 0) {
+            ws_message_fail(client, error, ws_message_reason(error));
+            return;
+        }
+        if (decoded) payload = decoded;
+    }
+
+    if (opcode == WS_TEXT && !ws_validate_utf8(payload, length)) {
+        ws_pool_free(decoded);
+        ws_message_fail(client, 1007, "Invalid UTF-8");
+        return;
+    }
+
+    if (target && target->on_message_chunk) {
+        target->on_message_chunk(client, (const char*)payload, length, opcode, 1);
+    } else if (target && target->on_message) {
+        target->on_message(client, (const char*)payload, length, opcode);
+    }
+
+    ws_pool_free(decoded);
+    ws_message_done(client);
+}
+
+// Handle a TEXT, BINARY or CONTINUATION frame
+void ws_client_message_frame(ws_client_t *client, ws_frame_t *frame) {
+    ws_event_target_t *target = client->server->event_target;
+
+    if (frame->opcode == WS_CONTINUATION) {
+        if (client->message_opcode == WS_CONTINUATION) {
+            ws_message_fail(client, 1002, "Unexpected continuation frame");
+            return;
+        }
+    } else {
+        if (client->message_opcode != WS_CONTINUATION) {
+            ws_message_fail(client, 1002, "Expected continuation frame");
+            return;
+        }
+        client->message_opcode = frame->opcode;
+        client->message_rsv = (frame->rsv1 << 6) | (frame->rsv2 << 5) | (frame->rsv3 << 4);
+        client->message_length = 0;
+        ws_utf8_init(&client->message_utf8);
+    }
+
+    client->message_length += frame->payload_length;
+    if (client->message_length > client->server->max_message_size) {
+        ws_message_fail(client, 1009, "Message too big");
+        return;
+    }
+
+    int streaming = target && target->on_message_chunk &&
+                    (!client->message_rsv || ws_extensions_stream_decoder(client, client->message_rsv));
+
+    if (streaming) {
+        if (ws_message_stream(client, frame) == 0 && frame->fin) {
+            ws_message_done(client);
+        }
+        return;
+    }
+
+    // An unfragmented message is delivered straight from the frame
+    if (frame->fin && frame->opcode != WS_CONTINUATION) {
+        ws_message_deliver(client, frame->payload, frame->payload_length);
+        return;
+    }
+
+    if (!client->message) {
+        client->message = ws_buffer_create(frame->payload_length > BUFFER_SIZE ? frame->payload_length : BUFFER_SIZE);
+    }
+    if (!client->message || ws_buffer_append(client->message, frame->payload, frame->payload_length) < 0) {
+        ws_message_fail(client, 1011, "Out of memory");
+        return;
+    }
+
+    if (frame->fin) {
+        ws_message_deliver(client, client->message->data, client->message->size);
+    }
+}
@@ -1,84 +1,677 @@
 #include "websocket.h"
 
-ws_compression_t* ws_compression_create(void) {
-    ws_compression_t *comp = malloc(sizeof(ws_compression_t));
-    if (!comp) return NULL;
+#ifdef WS_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#define WS_LIBDEFLATE_LEVELS 13
+#endif
 
-    comp->initialized = 0;
+// Every message ends with an empty stored block after a sync flush; RFC 7692
+// strips it on the wire and the receiver appends it back before inflating
+static const uint8_t ws_deflate_tail[4] = {0x00, 0x00, 0xff, 0xff};
 
-    // Initialize deflate stream
-    comp->deflate_stream.zalloc = Z_NULL;
-    comp->deflate_stream.zfree = Z_NULL;
-    comp->deflate_stream.opaque = Z_NULL;
+// Per-thread cache of idle zlib streams. A deflate context with a 32 KiB
+// window and memLevel 8 holds about 256 KiB, so connections that reset their
+// context after every message borrow one here instead of owning it.
+#define WS_ZSTREAM_POOL_SIZE 4
 
-    if (deflateInit2(&comp->deflate_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
-        free(comp);
-        return NULL;
+struct ws_zstream {
+    z_stream stream;
+    int inflate;                // Inflater rather than deflater
+    int window_bits;
+    int level;
+    int mem_level;
+};
+
+typedef struct {
+    ws_zstream_t *idle[WS_ZSTREAM_POOL_SIZE];
+    int count;
+#ifdef WS_HAVE_LIBDEFLATE
+    struct libdeflate_compressor *compressors[WS_LIBDEFLATE_LEVELS]; // By level, made on first use
+#endif
+} ws_zstream_pool_t;
+
+static __thread ws_zstream_pool_t *ws_zstream_local = NULL;
+static pthread_key_t ws_zstream_key;
+static pthread_once_t ws_zstream_once = PTHREAD_ONCE_INIT;
+
+static void ws_zstream_free(ws_zstream_t *z) {
+    if (z->inflate) {
+        inflateEnd(&z->stream);
+    } else {
+        deflateEnd(&z->stream);
     }
+    free(z);
+}
 
-    // Initialize inflate stream
-    comp->inflate_stream.zalloc = Z_NULL;
-    comp->inflate_stream.zfree = Z_NULL;
-    comp->inflate_stream.opaque = Z_NULL;
+static void ws_zstream_thread_exit(void *arg) {
+    ws_zstream_pool_t *pool = (ws_zstream_pool_t*)arg;
 
-    if (inflateInit2(&comp->inflate_stream, -15) != Z_OK) {
-        deflateEnd(&comp->deflate_stream);
-        free(comp);
+    ws_zstream_local = NULL;
+    for (int i = 0; i < pool->count; i++) {
+        ws_zstream_free(pool->idle[i]);
+    }
+#ifdef WS_HAVE_LIBDEFLATE
+    for (int i = 0; i < WS_LIBDEFLATE_LEVELS; i++) {
+        if (pool->compressors[i]) libdeflate_free_compressor(pool->compressors[i]);
+    }
+#endif
+    free(pool);
+}
+
+static void ws_zstream_init_key(void) {
+    pthread_key_create(&ws_zstream_key, ws_zstream_thread_exit);
+}
+
+static ws_zstream_pool_t* ws_zstream_pool(void) {
+    if (ws_zstream_local) return ws_zstream_local;
+
+    pthread_once(&ws_zstream_once, ws_zstream_init_key);
+
+    ws_zstream_pool_t *pool = calloc(1, sizeof(ws_zstream_pool_t));
+    if (!pool) return NULL;
+
+    pthread_setspecific(ws_zstream_key, pool);
+    ws_zstream_local = pool;
+    return pool;
+}
+
+static ws_zstream_t* ws_zstream_create(int inflate, const ws_deflate_params_t *params) {
+    ws_zstream_t *z = calloc(1, sizeof(ws_zstream_t));
+    if (!z) return NULL;
+
+    z->inflate = inflate;
+    z->window_bits = inflate ? params->client_max_window_bits : params->server_max_window_bits;
+    z->level = params->level;
+    z->mem_level = params->mem_level;
+
+    // Negative window bits select a raw deflate stream
+    int result = inflate ? inflateInit2(&z->stream, -z->window_bits)
+                         : deflateInit2(&z->stream, z->level, Z_DEFLATED, -z->window_bits, z->mem_level,
+                                        Z_DEFAULT_STRATEGY);
+    if (result != Z_OK) {
+        free(z);
         return NULL;
     }
 
+    return z;
+}
+
+// Take a matching idle stream from this thread's pool, or make one
+static ws_zstream_t* ws_zstream_borrow(int inflate, const ws_deflate_params_t *params) {
+    ws_zstream_pool_t *pool = ws_zstream_pool();
+    int window_bits = inflate ? params->client_max_window_bits : params->server_max_window_bits;
+
+    for (int i = 0; pool && i < pool->count; i++) {
+        ws_zstream_t *z = pool->idle[i];
+        if (z->inflate == inflate && z->window_bits == window_bits &&
+            (inflate || (z->level == params->level && z->mem_level == params->mem_level))) {
+            pool->idle[i] = pool->idle[--pool->count];
+            return z;
+        }
+    }
+
+    return ws_zstream_create(inflate, params);
+}
+
+static void ws_zstream_return(ws_zstream_t *z) {
+    ws_zstream_pool_t *pool = ws_zstream_pool();
+
+    if (!pool || pool->count == WS_ZSTREAM_POOL_SIZE) {
+        ws_zstream_free(z);
+        return;
+    }
+
+    if (z->inflate) {
+        inflateReset(&z->stream);
+    } else {
+        deflateReset(&z->stream);
+    }
+    pool->idle[pool->count++] = z;
+}
+
+ws_compression_t* ws_compression_create(const ws_deflate_params_t *params) {
+    ws_compression_t *comp = malloc(sizeof(ws_compression_t));
+    if (!comp) return NULL;
+
+    comp->deflater = NULL;
+    comp->inflater = NULL;
+    comp->params = *params;
+    comp->threshold = 0;
+    comp->message_inflater = NULL;
+    comp->message_total = 0;
+    comp->message_ended = 0;
+    comp->error = 0;
     comp->initialized = 1;
     return comp;
 }
 
 void ws_compression_destroy(ws_compression_t *comp) {
     if (comp && comp->initialized) {
-        deflateEnd(&comp->deflate_stream);
-        inflateEnd(&comp->inflate_stream);
+        // A pooled stream still held by an unfinished message
+        if (comp->message_inflater && comp->message_inflater != comp->inflater) {
+            ws_zstream_free(comp->message_inflater);
+        }
+        if (comp->deflater) ws_zstream_free(comp->deflater);
+        if (comp->inflater) ws_zstream_free(comp->inflater);
         free(comp);
     }
 }
 
-int ws_compression_deflate(ws_compression_t *comp, const uint8_t *input, size_t input_len, uint8_t **output, size_t *output_len) {
-    if (!comp || !comp->initialized) return -1;
+// Stream for one message: the connection's own when the context carries over
+// to the next message, otherwise a pooled one (give it back with ws_compression_release)
+static ws_zstream_t* ws_compression_acquire(ws_compression_t *comp, int inflate) {
+    ws_zstream_t **owned = inflate ? &comp->inflater : &comp->deflater;
+    int takeover = inflate ? !comp->params.client_no_context_takeover : !comp->params.server_no_context_takeover;
+
+    if (!takeover) return ws_zstream_borrow(inflate, &comp->params);
+
+    if (!*owned) {
+        *owned = ws_zstream_create(inflate, &comp->params);
+    }
+    return *owned;
+}
 
-    size_t max_output = deflateBound(&comp->deflate_stream, input_len);
-    *output = malloc(max_output);
+// Finish a message. A failed deflate never reaches the peer and a failed (or
+// BFINAL-terminated) inflate leaves no usable history, so both reset the context.
+static void ws_compression_release(ws_compression_t *comp, ws_zstream_t *z, int failed) {
+    if (z != comp->deflater && z != comp->inflater) {
+        ws_zstream_return(z);
+    } else if (failed) {
+        if (z->inflate) {
+            inflateReset(&z->stream);
+        } else {
+            deflateReset(&z->stream);
+        }
+    }
+}
+
+// Deflate one message body with a sync flush and strip the trailing
+// 00 00 ff ff. The stream is left ready for the next message.
+static int ws_deflate_message(z_stream *stream, const uint8_t *input, size_t input_len,
+                              uint8_t **output, size_t *output_len) {
+    size_t capacity = deflateBound(stream, input_len) + 16;
+    size_t length = 0;
+
+    *output = ws_pool_alloc(capacity);
     if (!*output) return -1;
 
-    comp->deflate_stream.next_in = (Bytef*)input;
-    comp->deflate_stream.avail_in = input_len;
-    comp->deflate_stream.next_out = *output;
-    comp->deflate_stream.avail_out = max_output;
+    stream->next_in = (Bytef*)input;
+    stream->avail_in = input_len;
 
-    int result = deflate(&comp->deflate_stream, Z_SYNC_FLUSH);
-    if (result != Z_OK) {
-        free(*output);
+    for (;;) {
+        stream->next_out = *output + length;
+        stream->avail_out = capacity - length;
+
+        int result = deflate(stream, Z_SYNC_FLUSH);
+        length = capacity - stream->avail_out;
+        if (result != Z_OK && result != Z_BUF_ERROR) break;
+
+        // Done once the flush fits with room to spare
+        if (stream->avail_in == 0 && stream->avail_out > 0) {
+            if (length < sizeof(ws_deflate_tail) ||
+                memcmp(*output + length - sizeof(ws_deflate_tail), ws_deflate_tail, sizeof(ws_deflate_tail)) != 0) {
+                break;
+            }
+
+            *output_len = length - sizeof(ws_deflate_tail);
+            return 0;
+        }
+
+        uint8_t *grown = ws_pool_realloc(*output, capacity * 2);
+        if (!grown) break;
+        *output = grown;
+        capacity *= 2;
+    }
+
+    ws_pool_free(*output);
+    *output = NULL;
+    return -1;
+}
+
+#ifdef WS_HAVE_LIBDEFLATE
+// libdeflate compresses a whole buffer in one call, several times faster than
+// zlib, but always with a 32 KiB window and no history carried between
+// messages. Its output ends in a BFINAL block instead of a sync flush, which
+// RFC 7692 section 7.2.3.4 allows, so there is no tail to strip.
+static int ws_libdeflate_usable(const ws_deflate_params_t *params) {
+    return params->backend != WS_DEFLATE_BACKEND_ZLIB && params->server_max_window_bits == 15;
+}
+
+static int ws_libdeflate_message(const ws_deflate_params_t *params, const uint8_t *input, size_t input_len,
+                                 uint8_t **output, size_t *output_len) {
+    ws_zstream_pool_t *pool = ws_zstream_pool();
+    int level = params->level < 0 ? 6 : params->level;
+
+    if (!pool) return -1;
+
+    if (!pool->compressors[level]) {
+        pool->compressors[level] = libdeflate_alloc_compressor(level);
+        if (!pool->compressors[level]) return -1;
+    }
+
+    struct libdeflate_compressor *compressor = pool->compressors[level];
+    size_t capacity = libdeflate_deflate_compress_bound(compressor, input_len);
+
+    *output = ws_pool_alloc(capacity);
+    if (!*output) return -1;
+
+    *output_len = libdeflate_deflate_compress(compressor, input, input_len, *output, capacity);
+    if (*output_len == 0) {
+        ws_pool_free(*output);
+        *output = NULL;
         return -1;
     }
 
-    *output_len = max_output - comp->deflate_stream.avail_out;
     return 0;
 }
+#endif
 
-int ws_compression_inflate(ws_compression_t *comp, const uint8_t *input, size_t input_len, uint8_t **output, size_t *output_len) {
+// Compress one complete message payload for a frame with RSV1 set
+int ws_compression_deflate(ws_compression_t *comp, const uint8_t *input, size_t input_len, uint8_t **output, size_t *output_len) {
     if (!comp || !comp->initialized) return -1;
 
-    size_t max_output = input_len * 4; // Estimate
-    *output = malloc(max_output);
-    if (!*output) return -1;
+#ifdef WS_HAVE_LIBDEFLATE
+    if (comp->params.server_no_context_takeover && ws_libdeflate_usable(&comp->params)) {
+        return ws_libdeflate_message(&comp->params, input, input_len, output, output_len);
+    }
+#endif
+
+    ws_zstream_t *z = ws_compression_acquire(comp, 0);
+    if (!z) return -1;
+
+    int result = ws_deflate_message(&z->stream, input, input_len, output, output_len);
+    ws_compression_release(comp, z, result < 0);
+    return result;
+}
+
+typedef struct {
+    ws_inflate_sink_t sink;
+    void *ctx;
+    size_t total;
+    size_t max_output;
+} ws_inflate_run_t;
+
+// Feed input to the inflater through a fixed window, passing each piece on.
+// Returns 0 once the input is consumed, 1 at end of stream, -1 on error.
+static int ws_inflate_feed(ws_compression_t *comp, z_stream *stream, ws_inflate_run_t *run,
+                           const uint8_t *input, size_t input_len) {
+    uint8_t window[WS_INFLATE_CHUNK];
+
+    stream->next_in = (Bytef*)input;
+    stream->avail_in = input_len;
+
+    do {
+        stream->next_out = window;
+        stream->avail_out = sizeof(window);
+
+        int result = inflate(stream, Z_SYNC_FLUSH);
+        size_t produced = sizeof(window) - stream->avail_out;
+
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            comp->error = 1007;
+            return -1;
+        }
+
+        // Checked before anything is stored, so a bomb costs at most one window
+        if (produced > run->max_output - run->total) {
+            comp->error = 1009;
+            return -1;
+        }
+
+        run->total += produced;
+        if (produced > 0 && run->sink(run->ctx, window, produced) < 0) {
+            comp->error = 1011;
+            return -1;
+        }
+
+        // A block with BFINAL set ends the stream; anything after it is ignored
+        if (result == Z_STREAM_END) return 1;
+        if (result == Z_BUF_ERROR) break; // No progress possible: input consumed
+    } while (stream->avail_in > 0 || stream->avail_out == 0);
+
+    return 0;
+}
+
+// Decompress the next frame of a message received with RSV1 set, handing the
+// output to sink in pieces of at most WS_INFLATE_CHUNK bytes. The stream and
+// the output count are held from the first frame until the final one, which
+// also takes the stripped tail. Stops with error 1009 once the message's
+// output would exceed max_output. Returns 0, or -1 with comp->error set.
+int ws_compression_inflate_fragment(ws_compression_t *comp, const uint8_t *input, size_t input_len, int final,
+                                    size_t max_output, ws_inflate_sink_t sink, void *ctx) {
+    if (!comp || !comp->initialized) return -1;
+
+    comp->error = 0;
+
+    if (!comp->message_inflater) {
+        comp->message_inflater = ws_compression_acquire(comp, 1);
+        if (!comp->message_inflater) {
+            comp->error = 1011;
+            return -1;
+        }
+        comp->message_total = 0;
+        comp->message_ended = 0;
+    }
+
+    ws_zstream_t *z = comp->message_inflater;
+    ws_inflate_run_t run;
+    run.sink = sink;
+    run.ctx = ctx;
+    run.total = comp->message_total;
+    run.max_output = max_output;
+
+    int result = 0;
+    if (!comp->message_ended) {
+        result = ws_inflate_feed(comp, &z->stream, &run, input, input_len);
+        if (result == 0 && final) {
+            result = ws_inflate_feed(comp, &z->stream, &run, ws_deflate_tail, sizeof(ws_deflate_tail));
+        }
+        comp->message_ended = result == 1;
+    }
+    comp->message_total = run.total;
+
+    if (result < 0 || final) {
+        // After BFINAL the peer starts a fresh stream; after an error it is unusable
+        ws_compression_release(comp, z, result < 0 || comp->message_ended);
+        comp->message_inflater = NULL;
+    }
+
+    return result < 0 ? -1 : 0;
+}
+
+// Decompress one complete message; see ws_compression_inflate_fragment
+int ws_compression_inflate_stream(ws_compression_t *comp, const uint8_t *input, size_t input_len, size_t max_output,
+                                  ws_inflate_sink_t sink, void *ctx) {
+    return ws_compression_inflate_fragment(comp, input, input_len, 1, max_output, sink, ctx);
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    size_t limit;
+} ws_inflate_output_t;
+
+// Grow the output geometrically, but never past the message limit
+static int ws_inflate_collect(void *ctx, const uint8_t *data, size_t length) {
+    ws_inflate_output_t *output = (ws_inflate_output_t*)ctx;
 
-    comp->inflate_stream.next_in = (Bytef*)input;
-    comp->inflate_stream.avail_in = input_len;
-    comp->inflate_stream.next_out = *output;
-    comp->inflate_stream.avail_out = max_output;
+    if (output->length + length > output->capacity) {
+        size_t capacity = output->capacity * 2;
+        if (capacity < output->length + length) capacity = output->length + length;
+        if (capacity > output->limit) capacity = output->limit;
 
-    int result = inflate(&comp->inflate_stream, Z_SYNC_FLUSH);
-    if (result != Z_OK && result != Z_STREAM_END) {
-        free(*output);
+        uint8_t *grown = ws_pool_realloc(output->data, capacity);
+        if (!grown) return -1;
+        output->data = grown;
+        output->capacity = capacity;
+    }
+
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+    return 0;
+}
+
+// Decompress one message into a single pool buffer (release with ws_pool_free)
+int ws_compression_inflate(ws_compression_t *comp, const uint8_t *input, size_t input_len, size_t max_output,
+                           uint8_t **output, size_t *output_len) {
+    ws_inflate_output_t collected;
+
+    // The input size is only a starting hint
+    collected.capacity = input_len < 512 ? 1024 : input_len * 2;
+    if (collected.capacity > max_output) collected.capacity = max_output > 0 ? max_output : 1;
+    collected.length = 0;
+    collected.limit = max_output;
+    collected.data = ws_pool_alloc(collected.capacity);
+    if (!collected.data) {
+        if (comp) comp->error = 1011;
         return -1;
     }
 
-    *output_len = max_output - comp->inflate_stream.avail_out;
+    if (ws_compression_inflate_stream(comp, input, input_len, max_output, ws_inflate_collect, &collected) < 0) {
+        ws_pool_free(collected.data);
+        *output = NULL;
+        return -1;
+    }
+
+    *output = collected.data;
+    *output_len = collected.length;
     return 0;
 }
+
+// Compress a message with a fresh context into a complete RSV1 frame. Any
+// client that negotiated server_no_context_takeover can decode it, so a
+// broadcast compresses once for all of them.
+ws_shared_buffer_t* ws_deflate_frame_encode(const ws_deflate_params_t *params, ws_opcode_t opcode,
+                                            const uint8_t *payload, size_t length) {
+    uint8_t *compressed;
+    size_t compressed_len;
+    int result;
+
+#ifdef WS_HAVE_LIBDEFLATE
+    if (ws_libdeflate_usable(params)) {
+        result = ws_libdeflate_message(params, payload, length, &compressed, &compressed_len);
+    } else
+#endif
+    {
+        ws_zstream_t *z = ws_zstream_borrow(0, params);
+        if (!z) return NULL;
+
+        result = ws_deflate_message(&z->stream, payload, length, &compressed, &compressed_len);
+        ws_zstream_return(z);
+    }
+    if (result < 0) return NULL;
+
+    ws_shared_buffer_t *buffer = ws_frame_encode(opcode, compressed, compressed_len);
+    if (buffer) {
+        buffer->data[0] |= WS_RSV1;
+    }
+
+    ws_pool_free(compressed);
+    return buffer;
+}
+
+static const char* ws_deflate_skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    return p;
+}
+
+static int ws_deflate_token_equals(const char *p, size_t len, const char *token) {
+    return strlen(token) == len && strncasecmp(p, token, len) == 0;
+}
+
+// Parse a window bits value ("10" or "\"10\""); returns 8..15 or -1
+static int ws_deflate_window_bits(const char *p, size_t len) {
+    if (len >= 2 && p[0] == '"' && p[len - 1] == '"') {
+        p++;
+        len -= 2;
+    }
+
+    if (len == 1 && p[0] >= '8' && p[0] <= '9') return p[0] - '0';
+    if (len == 2 && p[0] == '1' && p[1] >= '0' && p[1] <= '5') return 10 + p[1] - '0';
+    return -1;
+}
+
+// Check one offer ("permessage-deflate; param; param=value") against our
+// limits and fill params. Returns 0 if we can accept it, -1 to decline it.
+static int ws_deflate_parse_offer(const char *offer, const char *end, const ws_deflate_params_t *limits,
+                                  ws_deflate_params_t *params) {
+    const char *p = ws_deflate_skip_space(offer, end);
+    int server_bits_offered = 0;
+    int client_bits_offered = 0;
+
+    memset(params, 0, sizeof(*params));
+    params->server_max_window_bits = 15;
+    params->client_max_window_bits = 15;
+
+    for (int first = 1; p < end; first = 0) {
+        const char *param_end = memchr(p, ';', end - p);
+        if (!param_end) param_end = end;
+
+        // Trim the parameter and split name=value
+        const char *name_end = param_end;
+        while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+
+        const char *value = memchr(p, '=', name_end - p);
+        const char *value_end = name_end;
+        if (value) {
+            name_end = value;
+            while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+            value = ws_deflate_skip_space(value + 1, value_end);
+        }
+
+        size_t name_len = name_end - p;
+        size_t value_len = value ? (size_t)(value_end - value) : 0;
+
+        if (first) {
+            if (value || !ws_deflate_token_equals(p, name_len, "permessage-deflate")) return -1;
+        } else if (ws_deflate_token_equals(p, name_len, "server_no_context_takeover")) {
+            if (value || params->server_no_context_takeover) return -1;
+            params->server_no_context_takeover = 1;
+        } else if (ws_deflate_token_equals(p, name_len, "client_no_context_takeover")) {
+            if (value || params->client_no_context_takeover) return -1;
+            params->client_no_context_takeover = 1;
+        } else if (ws_deflate_token_equals(p, name_len, "server_max_window_bits")) {
+            int bits = value ? ws_deflate_window_bits(value, value_len) : -1;
+            // zlib cannot produce a raw stream with a 256-byte window
+            if (bits < 9 || server_bits_offered) return -1;
+            params->server_max_window_bits = bits;
+            server_bits_offered = 1;
+        } else if (ws_deflate_token_equals(p, name_len, "client_max_window_bits")) {
+            int bits = value ? ws_deflate_window_bits(value, value_len) : 15;
+            if (bits < 0 || client_bits_offered) return -1;
+            params->client_max_window_bits = bits;
+            client_bits_offered = value ? 2 : 1;
+        } else {
+            return -1;
+        }
+
+        p = ws_deflate_skip_space(param_end + (param_end < end), end);
+    }
+
+    // client_max_window_bits only constrains the client if we echo a value;
+    // we may pick a smaller one whenever the client said it can cope
+    if (!client_bits_offered) {
+        params->client_max_window_bits = 15;
+    } else if (limits->client_max_window_bits < params->client_max_window_bits) {
+        params->client_max_window_bits = limits->client_max_window_bits;
+    }
+
+    // An offered server_max_window_bits must be echoed to be accepted, and we
+    // may always announce a smaller window of our own
+    params->server_max_window_bits_set = server_bits_offered;
+    if (limits->server_max_window_bits < params->server_max_window_bits) {
+        params->server_max_window_bits = limits->server_max_window_bits;
+        params->server_max_window_bits_set = 1;
+    }
+
+    // Either side's context reset may be imposed by the server
+    params->server_no_context_takeover |= limits->server_no_context_takeover;
+    params->client_no_context_takeover |= limits->client_no_context_takeover;
+
+    params->level = limits->level;
+    params->mem_level = limits->mem_level;
+    params->backend = limits->backend;
+    params->enabled = 1;
+    return 0;
+}
+
+// Pick the first acceptable permessage-deflate offer from a
+// Sec-WebSocket-Extensions value and format our response parameters.
+// Returns 1 when accepted, 0 when no offer is acceptable.
+int ws_deflate_negotiate(const char *offers, const ws_deflate_params_t *limits, ws_deflate_params_t *params,
+                         char *response, size_t response_size) {
+    const char *p = offers;
+    const char *end = offers + strlen(offers);
+
+    while (p < end) {
+        const char *offer_end = memchr(p, ',', end - p);
+        if (!offer_end) offer_end = end;
+
+        if (ws_deflate_parse_offer(p, offer_end, limits, params) == 0) {
+            int length = snprintf(response, response_size, "permessage-deflate%s%s",
+                                  params->server_no_context_takeover ? "; server_no_context_takeover" : "",
+                                  params->client_no_context_takeover ? "; client_no_context_takeover" : "");
+
+            if (length >= 0 && params->server_max_window_bits_set && (size_t)length < response_size) {
+                length += snprintf(response + length, response_size - length, "; server_max_window_bits=%d",
+                                   params->server_max_window_bits);
+            }
+
+            if (length >= 0 && params->client_max_window_bits != 15 && (size_t)length < response_size) {
+                length += snprintf(response + length, response_size - length, "; client_max_window_bits=%d",
+                                   params->client_max_window_bits);
+            }
+
+            return length >= 0 && (size_t)length < response_size;
+        }
+
+        p = offer_end + 1;
+    }
+
+    return 0;
+}
+
+// Extension hooks: the context is the connection's ws_compression_t
+
+static int ws_permessage_deflate_negotiate(ws_client_t *client, const char *offer, char *response,
+                                           size_t response_size, void **context) {
+    ws_deflate_params_t params;
+
+    if (!ws_deflate_negotiate(offer, &client->server->deflate_limits, &params, response, response_size)) return 0;
+
+    ws_compression_t *comp = ws_compression_create(&params);
+    if (!comp) return 0;
+
+    comp->threshold = client->server->deflate_threshold;
+    client->deflate = params;
+    *context = comp;
+    return 1;
+}
+
+static int ws_permessage_deflate_encode(void *context, ws_opcode_t opcode, const uint8_t *input, size_t input_len,
+                                        uint8_t **output, size_t *output_len) {
+    ws_compression_t *comp = (ws_compression_t*)context;
+
+    if ((opcode != WS_TEXT && opcode != WS_BINARY) || input_len < comp->threshold) return 0;
+
+    // A failed deflate resets the stream, so the message can still go out uncompressed
+    return ws_compression_deflate(comp, input, input_len, output, output_len) == 0;
+}
+
+static int ws_permessage_deflate_decode(void *context, const uint8_t *input, size_t input_len, size_t max_output,
+                                        uint8_t **output, size_t *output_len, uint16_t *error) {
+    ws_compression_t *comp = (ws_compression_t*)context;
+
+    if (ws_compression_inflate(comp, input, input_len, max_output, output, output_len) < 0) {
+        *error = comp->error ? comp->error : 1011;
+        return -1;
+    }
+    return 1;
+}
+
+static int ws_permessage_deflate_decode_stream(void *context, const uint8_t *input, size_t input_len, int final,
+                                               size_t max_output, ws_data_sink_t sink, void *sink_ctx,
+                                               uint16_t *error) {
+    ws_compression_t *comp = (ws_compression_t*)context;
+
+    if (ws_compression_inflate_fragment(comp, input, input_len, final, max_output, sink, sink_ctx) < 0) {
+        *error = comp->error ? comp->error : 1011;
+        return -1;
+    }
+    return 0;
+}
+
+static void ws_permessage_deflate_destroy(void *context) {
+    ws_compression_destroy((ws_compression_t*)context);
+}
+
+const ws_extension_t ws_permessage_deflate = {
+    "permessage-deflate",
+    WS_RSV1,
+    ws_permessage_deflate_negotiate,
+    ws_permessage_deflate_encode,
+    ws_permessage_deflate_decode,
+    ws_permessage_deflate_decode_stream,
+    ws_permessage_deflate_destroy
+};
@@ -0,0 +1,197 @@
+#include "websocket.h"
+
+// Size-classed allocator with per-thread free lists
+//
+// Blocks carry a small header naming their class, so any thread may free
+// them; a freed block goes to the freeing thread's cache. Each cache holds at
+// most WS_POOL_CACHE_BYTES per class, and is returned to malloc when its
+// thread exits, so idle memory stays bounded. Requests above the largest
+// class go straight to malloc.
+#define WS_POOL_MIN_SHIFT 6                                 // 64 bytes
+#define WS_POOL_CLASSES 11                                  // ... 64 KiB
+#define WS_POOL_LARGE WS_POOL_CLASSES
+#define WS_POOL_CACHE_BYTES (512 * 1024)
+
+typedef struct {
+    size_t size_class;
+    size_t size;                // Usable bytes after the header
+} ws_pool_header_t;
+
+typedef struct ws_pool_free_block {
+    struct ws_pool_free_block *next;
+} ws_pool_free_block_t;
+
+typedef struct ws_pool_cache {
+    ws_pool_free_block_t *free[WS_POOL_CLASSES];
+    size_t count[WS_POOL_CLASSES];
+    uint64_t hits;
+    uint64_t misses;
+    size_t bytes_held;
+    int64_t bytes_in_use;       // Can go negative when other threads free our blocks
+    struct ws_pool_cache *next;
+} ws_pool_cache_t;
+
+static __thread ws_pool_cache_t *ws_pool_local = NULL;
+static pthread_key_t ws_pool_key;
+static pthread_once_t ws_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ws_pool_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ws_pool_cache_t *ws_pool_registry = NULL;
+static uint64_t ws_pool_retired_hits = 0;
+static uint64_t ws_pool_retired_misses = 0;
+static int64_t ws_pool_retired_in_use = 0;
+
+// Counters are only written by their own thread; relaxed stores keep the
+// cross-thread stats readers well defined without any contention
+#define WS_POOL_BUMP(field, delta) \
+    __atomic_store_n(&(field), (field) + (delta), __ATOMIC_RELAXED)
+
+static void ws_pool_thread_exit(void *arg) {
+    ws_pool_cache_t *cache = (ws_pool_cache_t*)arg;
+
+    ws_pool_local = NULL;
+
+    pthread_mutex_lock(&ws_pool_registry_mutex);
+    ws_pool_cache_t **link = &ws_pool_registry;
+    while (*link && *link != cache) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = cache->next;
+    }
+    ws_pool_retired_hits += cache->hits;
+    ws_pool_retired_misses += cache->misses;
+    ws_pool_retired_in_use += cache->bytes_in_use;
+    pthread_mutex_unlock(&ws_pool_registry_mutex);
+
+    for (int i = 0; i < WS_POOL_CLASSES; i++) {
+        while (cache->free[i]) {
+            ws_pool_free_block_t *block = cache->free[i];
+            cache->free[i] = block->next;
+            free((ws_pool_header_t*)block - 1);
+        }
+    }
+
+    free(cache);
+}
+
+static void ws_pool_init_key(void) {
+    pthread_key_create(&ws_pool_key, ws_pool_thread_exit);
+}
+
+static ws_pool_cache_t* ws_pool_cache(void) {
+    if (ws_pool_local) return ws_pool_local;
+
+    pthread_once(&ws_pool_once, ws_pool_init_key);
+
+    ws_pool_cache_t *cache = calloc(1, sizeof(ws_pool_cache_t));
+    if (!cache) return NULL;
+
+    pthread_mutex_lock(&ws_pool_registry_mutex);
+    cache->next = ws_pool_registry;
+    ws_pool_registry = cache;
+    pthread_mutex_unlock(&ws_pool_registry_mutex);
+
+    pthread_setspecific(ws_pool_key, cache);
+    ws_pool_local = cache;
+    return cache;
+}
+
+static size_t ws_pool_class_of(size_t size) {
+    size_t size_class = 0;
+    while (size_class < WS_POOL_CLASSES && ((size_t)1 << (size_class + WS_POOL_MIN_SHIFT)) < size) {
+        size_class++;
+    }
+    return size_class;
+}
+
+void* ws_pool_alloc(size_t size) {
+    size_t size_class = ws_pool_class_of(size);
+    ws_pool_cache_t *cache = ws_pool_cache();
+    ws_pool_header_t *header;
+
+    if (size_class < WS_POOL_CLASSES && cache && cache->free[size_class]) {
+        ws_pool_free_block_t *block = cache->free[size_class];
+        cache->free[size_class] = block->next;
+        cache->count[size_class]--;
+        header = (ws_pool_header_t*)block - 1;
+
+        WS_POOL_BUMP(cache->hits, 1);
+        WS_POOL_BUMP(cache->bytes_held, -header->size);
+    } else {
+        size_t usable = size_class < WS_POOL_CLASSES ? (size_t)1 << (size_class + WS_POOL_MIN_SHIFT) : size;
+
+        header = malloc(sizeof(ws_pool_header_t) + usable);
+        if (!header) return NULL;
+
+        header->size_class = size_class;
+        header->size = usable;
+
+        if (cache) {
+            WS_POOL_BUMP(cache->misses, 1);
+        }
+    }
+
+    if (cache) {
+        WS_POOL_BUMP(cache->bytes_in_use, (int64_t)header->size);
+    }
+    return header + 1;
+}
+
+void ws_pool_free(void *ptr) {
+    if (!ptr) return;
+
+    ws_pool_header_t *header = (ws_pool_header_t*)ptr - 1;
+    ws_pool_cache_t *cache = ws_pool_cache();
+
+    if (cache) {
+        WS_POOL_BUMP(cache->bytes_in_use, -(int64_t)header->size);
+    }
+
+    size_t size_class = header->size_class;
+    if (size_class == WS_POOL_LARGE || !cache ||
+        (cache->count[size_class] + 1) * header->size > WS_POOL_CACHE_BYTES) {
+        free(header);
+        return;
+    }
+
+    ws_pool_free_block_t *block = (ws_pool_free_block_t*)ptr;
+    block->next = cache->free[size_class];
+    cache->free[size_class] = block;
+    cache->count[size_class]++;
+
+    WS_POOL_BUMP(cache->bytes_held, header->size);
+}
+
+void* ws_pool_realloc(void *ptr, size_t size) {
+    if (!ptr) return ws_pool_alloc(size);
+
+    ws_pool_header_t *header = (ws_pool_header_t*)ptr - 1;
+    if (size <= header->size) return ptr;
+
+    void *grown = ws_pool_alloc(size);
+    if (!grown) return NULL;
+
+    memcpy(grown, ptr, header->size);
+    ws_pool_free(ptr);
+    return grown;
+}
+
+void ws_pool_get_stats(ws_pool_stats_t *stats) {
+    int64_t in_use;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&ws_pool_registry_mutex);
+    stats->hits = ws_pool_retired_hits;
+    stats->misses = ws_pool_retired_misses;
+    in_use = ws_pool_retired_in_use;
+    for (ws_pool_cache_t *cache = ws_pool_registry; cache; cache = cache->next) {
+        stats->hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+        stats->bytes_held += __atomic_load_n(&cache->bytes_held, __ATOMIC_RELAXED);
+        in_use += __atomic_load_n(&cache->bytes_in_use, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ws_pool_registry_mutex);
+
+    stats->bytes_in_use = in_use > 0 ? (size_t)in_use : 0;
+}
@@ -1,7 +1,8 @@
 #include "websocket.h"
 
+// Returns the number of bytes consumed, 0 if more data is needed, -1 on error
 int ws_parse_frame(const uint8_t *data, size_t length, ws_frame_t *frame) {
-    if (length < 2) return -1; // Minimum frame size
+    if (length < 2) return 0; // Minimum frame size
 
     size_t pos = 0;
 
@@ -20,11 +21,11 @@ int ws_parse_frame(const uint8_t *data, size_t length, ws_frame_t *frame) {
 
     // Extended payload length
     if (payload_len == 126) {
-        if (length < pos + 2) return -1;
+        if (length < pos + 2) return 0;
         frame->payload_length = (data[pos] << 8) | data[pos + 1];
         pos += 2;
     } else if (payload_len == 127) {
-        if (length < pos + 8) return -1;
+        if (length < pos + 8) return 0;
         frame->payload_length = 0;
         for (int i = 0; i < 8; i++) {
             frame->payload_length = (frame->payload_length << 8) | data[pos + i];
@@ -36,13 +37,13 @@ int ws_parse_frame(const uint8_t *data, size_t length, ws_frame_t *frame) {
 
     // Masking key
     if (frame->mask) {
-        if (length < pos + 4) return -1;
+        if (length < pos + 4) return 0;
         memcpy(frame->masking_key, data + pos, 4);
         pos += 4;
     }
 
     // Payload data
-    if (length < pos + frame->payload_length) return -1;
+    if (length < pos + frame->payload_length) return 0;
 
     frame->payload = malloc(frame->payload_length);
     if (!frame->payload) return -1;
@@ -56,3 +57,243 @@ int ws_parse_frame(const uint8_t *data, size_t length, ws_frame_t *frame) {
 
     return pos + frame->payload_length;
 }
+
+void ws_parser_init(ws_parser_t *parser, uint64_t max_payload, int require_mask) {
+    memset(parser, 0, sizeof(*parser));
+    parser->state = WS_PARSE_HEADER;
+    parser->max_payload = max_payload;
+    parser->require_mask = require_mask;
+}
+
+static void ws_parser_release_payload(ws_parser_t *parser) {
+    if (parser->payload_owned) {
+        ws_pool_free(parser->frame.payload);
+    } else if (parser->frame.payload == parser->spill && parser->spill_capacity > WS_PARSER_SPILL_KEEP) {
+        // Don't pin a huge spill buffer to an idle connection
+        ws_pool_free(parser->spill);
+        parser->spill = NULL;
+        parser->spill_capacity = 0;
+    }
+
+    parser->frame.payload = NULL;
+    parser->payload_owned = 0;
+}
+
+// Drop any partially received frame
+void ws_parser_reset(ws_parser_t *parser) {
+    ws_parser_release_payload(parser);
+    parser->state = WS_PARSE_HEADER;
+    parser->header_len = 0;
+    parser->payload_pos = 0;
+    parser->error = 0;
+}
+
+void ws_parser_destroy(ws_parser_t *parser) {
+    ws_parser_reset(parser);
+    ws_pool_free(parser->spill);
+    parser->spill = NULL;
+    parser->spill_capacity = 0;
+}
+
+// Total header size implied by the first two bytes
+static size_t ws_parser_header_size(const uint8_t *header) {
+    size_t size = 2;
+    uint8_t payload_len = header[1] & 0x7F;
+
+    if (payload_len == 126) {
+        size += 2;
+    } else if (payload_len == 127) {
+        size += 8;
+    }
+
+    if (header[1] & 0x80) {
+        size += 4;
+    }
+
+    return size;
+}
+
+static int ws_parser_fail(ws_parser_t *parser, uint16_t code) {
+    parser->error = code;
+    return -1;
+}
+
+// Decode and validate a complete header, then prepare the payload buffer
+static int ws_parser_begin_frame(ws_parser_t *parser) {
+    const uint8_t *header = parser->header;
+    ws_frame_t *frame = &parser->frame;
+    size_t pos = 2;
+
+    frame->fin = (header[0] & 0x80) >> 7;
+    frame->rsv1 = (header[0] & 0x40) >> 6;
+    frame->rsv2 = (header[0] & 0x20) >> 5;
+    frame->rsv3 = (header[0] & 0x10) >> 4;
+    frame->opcode = header[0] & 0x0F;
+    frame->mask = (header[1] & 0x80) >> 7;
+    frame->payload = NULL;
+
+    uint8_t payload_len = header[1] & 0x7F;
+    if (payload_len == 126) {
+        frame->payload_length = (header[2] << 8) | header[3];
+        pos += 2;
+    } else if (payload_len == 127) {
+        frame->payload_length = 0;
+        for (int i = 0; i < 8; i++) {
+            frame->payload_length = (frame->payload_length << 8) | header[2 + i];
+        }
+        pos += 8;
+        if (frame->payload_length >> 63) return ws_parser_fail(parser, 1002);
+    } else {
+        frame->payload_length = payload_len;
+    }
+
+    if (frame->mask) {
+        memcpy(frame->masking_key, header + pos, 4);
+    } else if (parser->require_mask) {
+        return ws_parser_fail(parser, 1002); // Client frames must be masked
+    }
+
+    if (header[0] & 0x70 & ~parser->allowed_rsv) {
+        return ws_parser_fail(parser, 1002); // RSV bit not claimed by an extension
+    }
+
+    // RSV1 marks a compressed message, so only the first frame of one may carry it
+    if (frame->rsv1 && (frame->opcode == WS_CONTINUATION || frame->opcode & 0x08)) {
+        return ws_parser_fail(parser, 1002);
+    }
+
+    switch (frame->opcode) {
+        case WS_CONTINUATION:
+        case WS_TEXT:
+        case WS_BINARY:
+            break;
+        case WS_CLOSE:
+        case WS_PING:
+        case WS_PONG:
+            // Control frames cannot be fragmented and carry at most 125 bytes
+            if (!frame->fin || frame->payload_length > 125) return ws_parser_fail(parser, 1002);
+            break;
+        default:
+            return ws_parser_fail(parser, 1002);
+    }
+
+    if (frame->payload_length > parser->max_payload) {
+        return ws_parser_fail(parser, 1009);
+    }
+
+    parser->payload_pos = 0;
+    return 0;
+}
+
+// Get storage for a payload that has to be copied out of the input chunks
+static int ws_parser_alloc_payload(ws_parser_t *parser) {
+    size_t length = parser->frame.payload_length;
+
+    if (!parser->zero_copy) {
+        parser->frame.payload = ws_pool_alloc(length);
+        if (!parser->frame.payload) return ws_parser_fail(parser, 1011);
+        parser->payload_owned = 1;
+        return 0;
+    }
+
+    if (parser->spill_capacity < length) {
+        // Nothing in the spill buffer survives into a new frame, so skip the copy
+        ws_pool_free(parser->spill);
+        parser->spill_capacity = 0;
+
+        uint8_t *spill = ws_pool_alloc(length);
+        parser->spill = spill;
+        if (!spill) return ws_parser_fail(parser, 1011);
+        parser->spill_capacity = length;
+    }
+
+    parser->frame.payload = parser->spill;
+    return 0;
+}
+
+// Consume an arbitrary chunk of bytes, emitting every frame it completes.
+// In zero-copy mode a frame that lies entirely within the chunk is unmasked in
+// place and handed out as a view, valid only until on_frame returns.
+// Returns 0 when the chunk is consumed, 1 if on_frame asked to stop (the
+// bytes after that frame, from parser->consumed on, are left alone), -1 on a
+// protocol error (parser->error holds the close code).
+int ws_parser_feed(ws_parser_t *parser, uint8_t *data, size_t length,
+                   ws_frame_handler_t on_frame, void *ctx) {
+    size_t pos = 0;
+
+    while (pos < length) {
+        if (parser->state == WS_PARSE_HEADER) {
+            // Collect the two fixed bytes first, then whatever else the header needs
+            size_t need = parser->header_len < 2 ? 2 : ws_parser_header_size(parser->header);
+            size_t take = need - parser->header_len;
+            if (take > length - pos) take = length - pos;
+
+            memcpy(parser->header + parser->header_len, data + pos, take);
+            parser->header_len += take;
+            pos += take;
+
+            if (parser->header_len < 2 || parser->header_len < ws_parser_header_size(parser->header)) {
+                continue;
+            }
+
+            if (ws_parser_begin_frame(parser) < 0) return -1;
+
+            if (parser->frame.payload_length > 0) {
+                parser->state = WS_PARSE_PAYLOAD;
+                continue;
+            }
+        } else if (parser->zero_copy && parser->payload_pos == 0 &&
+                   parser->frame.payload_length <= length - pos) {
+            // Whole payload is in this chunk: unmask in place, no copy
+            ws_frame_t *frame = &parser->frame;
+            frame->payload = data + pos;
+
+            if (frame->mask) {
+                ws_apply_mask(frame->payload, frame->payload_length, frame->masking_key);
+            }
+
+            pos += frame->payload_length;
+        } else {
+            ws_frame_t *frame = &parser->frame;
+
+            if (!frame->payload && ws_parser_alloc_payload(parser) < 0) return -1;
+
+            uint64_t remaining = frame->payload_length - parser->payload_pos;
+            size_t take = remaining < length - pos ? (size_t)remaining : length - pos;
+            uint8_t *dest = frame->payload + parser->payload_pos;
+
+            memcpy(dest, data + pos, take);
+
+            // Apply mask if present, rotated to the current payload offset
+            if (frame->mask) {
+                uint8_t mask[4];
+                for (int i = 0; i < 4; i++) {
+                    mask[i] = frame->masking_key[(parser->payload_pos + i) % 4];
+                }
+                ws_apply_mask(dest, take, mask);
+            }
+
+            parser->payload_pos += take;
+            pos += take;
+
+            if (parser->payload_pos < frame->payload_length) {
+                continue;
+            }
+        }
+
+        // Frame complete: hand it out, then recycle the payload storage
+        int stop = on_frame(ctx, &parser->frame);
+
+        ws_parser_release_payload(parser);
+        parser->state = WS_PARSE_HEADER;
+        parser->header_len = 0;
+        parser->payload_pos = 0;
+
+        if (stop) {
+            parser->consumed = pos;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -1,33 +1,110 @@
 #include "websocket.h"
 
-int ws_send_frame(int socket, ws_opcode_t opcode, const uint8_t *payload, size_t length) {
-    uint8_t frame[MAX_FRAME_SIZE];
-    size_t frame_size = 0;
+// Header for one frame of a message; fin marks the last one
+size_t ws_fragment_header_encode(uint8_t *header, ws_opcode_t opcode, size_t length, int fin) {
+    size_t header_size = 0;
 
-    // First byte: FIN=1, RSV=0, Opcode
-    frame[frame_size++] = 0x80 | (opcode & 0x0F);
+    // First byte: FIN, RSV=0, Opcode
+    header[header_size++] = (fin ? 0x80 : 0) | (opcode & 0x0F);
 
     // Second byte and extended length
     if (length < 126) {
-        frame[frame_size++] = length;
+        header[header_size++] = length;
     } else if (length < 65536) {
-        frame[frame_size++] = 126;
-        frame[frame_size++] = (length >> 8) & 0xFF;
-        frame[frame_size++] = length & 0xFF;
+        header[header_size++] = 126;
+        header[header_size++] = (length >> 8) & 0xFF;
+        header[header_size++] = length & 0xFF;
     } else {
-        frame[frame_size++] = 127;
+        header[header_size++] = 127;
         for (int i = 7; i >= 0; i--) {
-            frame[frame_size++] = (length >> (i * 8)) & 0xFF;
+            header[header_size++] = ((uint64_t)length >> (i * 8)) & 0xFF;
+        }
+    }
+
+    return header_size;
+}
+
+size_t ws_frame_header_encode(uint8_t *header, ws_opcode_t opcode, size_t length) {
+    return ws_fragment_header_encode(header, opcode, length, 1);
+}
+
+// Drop n bytes from the front of an iovec array
+static void ws_iov_advance(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (uint8_t*)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+// Gather-write iovecs to the socket, advancing *iov / *iovcnt past what was
+// written. On a blocking socket everything is written; on a non-blocking one
+// (or with MSG_DONTWAIT in flags) we stop at EAGAIN. Returns the number of
+// bytes written or -1 on error.
+static ssize_t ws_sendv(int socket, struct iovec **iov, int *iovcnt, int flags) {
+    struct msghdr msg;
+    ssize_t total = 0;
+
+    // Skip empty entries up front so a zero-length frame body costs nothing
+    ws_iov_advance(iov, iovcnt, 0);
+
+    while (*iovcnt > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = *iov;
+        msg.msg_iovlen = *iovcnt;
+
+        ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL | flags);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
         }
+
+        total += sent;
+        ws_iov_advance(iov, iovcnt, sent);
     }
 
-    // Payload data
-    if (payload && length > 0) {
-        memcpy(frame + frame_size, payload, length);
-        frame_size += length;
+    return total;
+}
+
+// Header and payload go out through one sendmsg() without copying the
+// payload, so frame size is not bounded by a stack buffer.
+int ws_send_frame(int socket, ws_opcode_t opcode, const uint8_t *payload, size_t length) {
+    uint8_t header[WS_MAX_HEADER_SIZE];
+    struct iovec iov[2];
+    struct iovec *pending = iov;
+    int count = 2;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = ws_frame_header_encode(header, opcode, length);
+    iov[1].iov_base = (void*)payload;
+    iov[1].iov_len = payload ? length : 0;
+
+    ssize_t sent = ws_sendv(socket, &pending, &count, 0);
+    if (sent < 0) return -1;
+
+    return sent > INT_MAX ? INT_MAX : (int)sent;
+}
+
+// Encode a complete frame into a new shared buffer
+ws_shared_buffer_t* ws_frame_encode(ws_opcode_t opcode, const uint8_t *payload, size_t length) {
+    uint8_t header[WS_MAX_HEADER_SIZE];
+    size_t header_len = ws_frame_header_encode(header, opcode, length);
+
+    ws_shared_buffer_t *buffer = ws_shared_buffer_create(header_len + length);
+    if (!buffer) return NULL;
+
+    memcpy(buffer->data, header, header_len);
+    if (length > 0) {
+        memcpy(buffer->data + header_len, payload, length);
     }
 
-    return send(socket, frame, frame_size, 0);
+    return buffer;
 }
 
 int ws_send_text(int socket, const char *message) {
@@ -46,8 +123,7 @@ int ws_send_pong(int socket, const uint8_t *data, size_t length) {
     return ws_send_frame(socket, WS_PONG, data, length);
 }
 
-int ws_send_close(int socket, uint16_t code, const char *reason) {
-    uint8_t payload[125];
+static size_t ws_close_payload(uint8_t *payload, uint16_t code, const char *reason) {
     size_t payload_len = 0;
 
     // Close code (2 bytes, big endian)
@@ -62,5 +138,624 @@ int ws_send_close(int socket, uint16_t code, const char *reason) {
         payload_len += reason_len;
     }
 
+    return payload_len;
+}
+
+int ws_send_close(int socket, uint16_t code, const char *reason) {
+    uint8_t payload[125];
+    size_t payload_len = ws_close_payload(payload, code, reason);
+
     return ws_send_frame(socket, WS_CLOSE, payload, payload_len);
 }
+
+// Returns 0 when drained, 1 when data is still pending, -1 on error.
+// Caller must hold client->mutex.
+static int ws_client_flush_locked(ws_client_t *client) {
+    return ws_write_queue_flush(&client->write_queue, client->socket);
+}
+
+// Write out queued (and corked) frames now, as far as the socket takes them.
+// Once the queue falls to the low watermark, wake blocked producers and fire
+// on_drain if the client had been marked unwritable. Returns 0 when drained,
+// 1 when data is still pending, -1 on error.
+int ws_client_flush(ws_client_t *client) {
+    if (!client) return -1;
+
+    int drained = 0;
+
+    // Its own thread, mid-message, writes the queue out once it is done
+    pthread_mutex_lock(&client->mutex);
+    int result = client->fragmenting ? 1 : ws_client_flush_locked(client);
+    if (result >= 0 && client->write_queue.bytes <= client->server->write_low_watermark) {
+        pthread_cond_broadcast(&client->writable);
+        drained = client->write_blocked;
+        client->write_blocked = 0;
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    if (drained) {
+        ws_client_emit_drain(client);
+    }
+
+    return result;
+}
+
+// Threaded model: the connection this thread reads and writes for
+static __thread ws_client_t *ws_owner_client = NULL;
+
+// Threaded model with corking: the connection whose received data this
+// thread is handling
+static __thread ws_client_t *ws_cork_client = NULL;
+
+static int ws_client_on_owner_thread(ws_client_t *client) {
+    if (!client->worker) return ws_owner_client == client;
+    return pthread_equal(pthread_self(), client->worker->thread);
+}
+
+// Threaded model: make the calling thread the connection's own, the one
+// that reads it and writes out what other threads queue. Returns 0 or -1.
+int ws_client_attach_thread(ws_client_t *client) {
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) return -1;
+
+    pthread_mutex_lock(&client->mutex);
+    client->wake_fd = wake_fd;
+    client->wake_pending = 0;
+    pthread_mutex_unlock(&client->mutex);
+
+    ws_owner_client = client;
+    return 0;
+}
+
+void ws_client_detach_thread(ws_client_t *client) {
+    ws_owner_client = NULL;
+
+    pthread_mutex_lock(&client->mutex);
+    if (client->wake_fd >= 0) close(client->wake_fd);
+    client->wake_fd = -1;
+    pthread_mutex_unlock(&client->mutex);
+}
+
+// Threaded model: called by the connection's thread before it waits.
+// Returns 1 if it should also wait for room to write (queued output, or a
+// drain to report).
+int ws_client_output_pending(ws_client_t *client) {
+    pthread_mutex_lock(&client->mutex);
+    client->wake_pending = 0;
+    int pending = client->write_queue.count > 0 || client->write_blocked;
+    pthread_mutex_unlock(&client->mutex);
+
+    return pending;
+}
+
+// Threaded model: output another thread left queued is written by the
+// connection's thread, which may be waiting for input only. Tell it, once
+// until it looks again. Caller must hold client->mutex.
+static void ws_client_wake_locked(ws_client_t *client) {
+    uint64_t one = 1;
+
+    if (client->wake_fd < 0 || client->wake_pending || ws_client_on_owner_thread(client)) return;
+
+    client->wake_pending = 1;
+    if (write(client->wake_fd, &one, sizeof(one)) < 0) {
+        client->wake_pending = 0;
+    }
+}
+
+// Corking: frames are queued rather than written, and go out together, one
+// gather write per connection, when its worker's loop pass ends (epoll
+// model) or when its thread is done with what it received (threaded model).
+// Large frames are not held back.
+static int ws_client_corking(ws_client_t *client, size_t length) {
+    if (!client->server || !client->server->cork || length >= WS_CORK_BYTES) return 0;
+    return client->worker || ws_cork_client == client;
+}
+
+// Epoll model: put the connection on its worker's list of corked ones.
+// Caller must hold client->mutex.
+static void ws_client_cork_locked(ws_client_t *client) {
+    if (!client->worker || __atomic_exchange_n(&client->corked, 1, __ATOMIC_ACQ_REL)) return;
+
+    ws_worker_t *worker = client->worker;
+    ws_client_t *head = __atomic_load_n(&worker->corked, __ATOMIC_RELAXED);
+    do {
+        client->next_corked = head;
+    } while (!__atomic_compare_exchange_n(&worker->corked, &head, client, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // The worker checks its list after every pass; one idle in epoll_wait
+    // needs waking, once
+    if (!head && !ws_client_on_owner_thread(client)) {
+        ws_worker_wake(worker);
+    }
+}
+
+// After queuing a message: write it now, or leave it for the end of the pass
+// while the corked output is small. Caller must hold client->mutex.
+static int ws_client_push_locked(ws_client_t *client) {
+    if (ws_client_corking(client, client->write_queue.bytes)) {
+        ws_client_cork_locked(client);
+        return 0;
+    }
+
+    // Its own thread is writing a message around the queue and takes the queue next
+    if (client->fragmenting) return 0;
+
+    int result = ws_client_flush_locked(client);
+    if (result > 0) {
+        ws_client_wake_locked(client);
+    }
+    return result < 0 ? -1 : 0;
+}
+
+// Threaded model: hold back what the callbacks for this connection's data
+// send until ws_client_uncork
+void ws_client_cork(ws_client_t *client) {
+    if (client->server->cork && !client->worker) ws_cork_client = client;
+}
+
+int ws_client_uncork(ws_client_t *client) {
+    if (ws_cork_client != client) return 0;
+
+    ws_cork_client = NULL;
+    return ws_client_flush(client);
+}
+
+// Make room for total more bytes under the server's slow-client policy.
+// Control frames and writes to an empty queue are always admitted, so a
+// single message may overshoot the high watermark once.
+// Returns 0 if the bytes may be queued, -1 if they must be discarded.
+// Caller must hold client->mutex.
+static int ws_client_reserve_locked(ws_client_t *client, size_t total, int control) {
+    ws_server_t *server = client->server;
+    ws_write_queue_t *queue = &client->write_queue;
+
+    if (control || queue->count == 0 || queue->bytes + total <= server->write_high_watermark) {
+        return 0;
+    }
+
+    client->write_blocked = 1;
+
+    switch (server->slow_client_policy) {
+        case WS_SLOW_CLIENT_BLOCK:
+            // Blocking the loop that drains this queue would deadlock, so the
+            // owning worker falls back to dropping
+            if (!ws_client_on_owner_thread(client)) {
+                while (client->state == WS_STATE_OPEN && queue->count > 0 &&
+                       queue->bytes + total > server->write_high_watermark) {
+                    pthread_cond_wait(&client->writable, &client->mutex);
+                }
+                return client->state == WS_STATE_OPEN ? 0 : -1;
+            }
+            return -1;
+
+        case WS_SLOW_CLIENT_DISCONNECT:
+            // Let the owning worker see EOF and tear the connection down
+            ws_write_queue_clear(queue);
+            shutdown(client->socket, SHUT_RDWR);
+            return -1;
+
+        case WS_SLOW_CLIENT_DROP:
+        default:
+            return -1;
+    }
+}
+
+// Pings and pongs may overtake queued data at a frame boundary. A close
+// frame may not: nothing queued before it could be sent afterwards.
+static int ws_opcode_urgent(ws_opcode_t opcode) {
+    return opcode == WS_PING || opcode == WS_PONG;
+}
+
+// Payload bytes per frame for an outgoing message, 0 to send it whole.
+// Control frames cannot be fragmented.
+static size_t ws_client_fragment_size(ws_client_t *client, ws_opcode_t opcode, size_t length) {
+    size_t size = client->server ? client->server->fragment_size : 0;
+
+    if (size == 0 || opcode & 0x08 || length <= size) return 0;
+    return size;
+}
+
+// Threaded model: the connection's own thread writes its messages straight
+// from the caller's memory, waiting for the socket if need be. Other threads
+// (and corked messages) go through the write queue, under the slow-client
+// policy as in the event loop, so a peer that stops reading holds up only
+// its own thread.
+static int ws_client_writes_direct(ws_client_t *client, size_t length) {
+    if (!client->server) return 1;
+    if (client->server->mode != WS_MODE_THREADED) return 0;
+    return ws_client_on_owner_thread(client) && !ws_client_corking(client, length);
+}
+
+// Wait until the socket takes more, with the lock released so other threads
+// can queue meanwhile. Caller must hold client->mutex.
+static int ws_client_wait_socket_locked(ws_client_t *client) {
+    struct pollfd pfd;
+
+    pfd.fd = client->socket;
+    pfd.events = POLLOUT;
+
+    pthread_mutex_unlock(&client->mutex);
+    int ready = poll(&pfd, 1, -1);
+    pthread_mutex_lock(&client->mutex);
+
+    return ready < 0 && errno != EINTR ? -1 : 0;
+}
+
+// Direct writes: put all of iov on the wire. Caller must hold client->mutex.
+static int ws_client_write_all_locked(ws_client_t *client, struct iovec *iov, int count) {
+    while (ws_sendv(client->socket, &iov, &count, MSG_DONTWAIT) >= 0) {
+        if (count == 0) return 0;
+        if (ws_client_wait_socket_locked(client) < 0) return -1;
+    }
+    return -1;
+}
+
+// Direct writes: write out the queue, or with urgent_only just the pings and
+// pongs ahead of the rest. Caller must hold client->mutex.
+static int ws_client_drain_locked(ws_client_t *client, int urgent_only) {
+    for (;;) {
+        int result = urgent_only ? ws_write_queue_flush_urgent(&client->write_queue, client->socket)
+                                 : ws_client_flush_locked(client);
+        if (result <= 0) return result;
+        if (ws_client_wait_socket_locked(client) < 0) return -1;
+    }
+}
+
+// Between two frames of a message written around the queue, let control
+// frames that are waiting for the lock queue first. Caller must hold
+// client->mutex.
+static void ws_client_yield_locked(ws_client_t *client) {
+    while (__atomic_load_n(&client->controls_waiting, __ATOMIC_ACQUIRE) > 0 && client->state != WS_STATE_CLOSED) {
+        pthread_cond_wait(&client->writable, &client->mutex);
+    }
+}
+
+// Lock for a control frame, announcing it to a fragment writer
+static void ws_client_lock_control(ws_client_t *client) {
+    __atomic_add_fetch(&client->controls_waiting, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&client->mutex);
+    __atomic_sub_fetch(&client->controls_waiting, 1, __ATOMIC_ACQ_REL);
+}
+
+// Queue one frame behind any pending output (pings and pongs at the next
+// frame boundary). When nothing is pending it is written straight from the
+// caller's memory and only copied if the socket did not take all of it.
+// Caller must hold client->mutex and have reserved room.
+static int ws_client_enqueue_locked(ws_client_t *client, const uint8_t *header, size_t header_len,
+                                    const uint8_t *payload, size_t length, int urgent) {
+    struct iovec iov[2];
+    struct iovec *pending = iov;
+    int count = 2;
+    ssize_t sent = 0;
+
+    iov[0].iov_base = (void*)header;
+    iov[0].iov_len = header_len;
+    iov[1].iov_base = (void*)payload;
+    iov[1].iov_len = length;
+
+    if (client->write_queue.count == 0 && !client->fragmenting && !ws_client_corking(client, header_len + length)) {
+        sent = ws_sendv(client->socket, &pending, &count, MSG_DONTWAIT);
+        if (sent < 0) return -1;
+        if (count == 0) return 0;
+    }
+
+    // The whole frame is queued, with what was written as its offset, so the
+    // queue only ever holds complete frames
+    ws_shared_buffer_t *buffer = ws_shared_buffer_create(header_len + length);
+    if (!buffer) return -1;
+
+    if (header_len > 0) memcpy(buffer->data, header, header_len);
+    if (length > 0) memcpy(buffer->data + header_len, payload, length);
+
+    int result = urgent ? ws_write_queue_push_urgent(&client->write_queue, buffer, sent)
+                        : ws_write_queue_push(&client->write_queue, buffer, sent);
+    ws_shared_buffer_release(buffer);
+    if (result < 0) return -1;
+
+    if (client->write_queue.bytes >= client->server->write_high_watermark) {
+        client->write_blocked = 1;
+    }
+
+    return 0;
+}
+
+int ws_client_write_raw(ws_client_t *client, const uint8_t *data, size_t length) {
+    if (!client) return -1;
+
+    pthread_mutex_lock(&client->mutex);
+    int result = ws_client_enqueue_locked(client, NULL, 0, data, length, 0);
+    if (result == 0) {
+        result = ws_client_flush_locked(client);
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    return result;
+}
+
+// Write a message as one frame, or as frames of step payload bytes when step
+// is set; only the first carries the opcode and extension bits.
+// Threaded model, on the connection's own thread: written straight from the
+// caller's memory behind what is queued, letting pings and pongs from other
+// threads go between frames.
+// Otherwise every frame is queued at once behind pending output, where pings
+// and pongs can still slot in between them.
+// Returns the bytes put on the wire or queued, -1 on error.
+// Caller must hold client->mutex.
+static ssize_t ws_client_write_message_locked(ws_client_t *client, ws_opcode_t opcode, uint8_t rsv,
+                                              const uint8_t *payload, size_t length, size_t step) {
+    int direct = ws_client_writes_direct(client, length);
+    uint8_t header[WS_MAX_HEADER_SIZE];
+    size_t offset = 0;
+    ssize_t total = 0;
+
+    if (!direct) {
+        // The message is admitted or dropped as a whole
+        size_t frames = step ? (length + step - 1) / step : 1;
+        if (ws_client_reserve_locked(client, length + frames * WS_MAX_HEADER_SIZE, opcode & 0x08) < 0) {
+            return -1;
+        }
+    } else {
+        // Frames corked, or queued by other threads, before this one go out first
+        if (ws_client_drain_locked(client, 0) < 0) return -1;
+        client->fragmenting = 1;
+    }
+
+    do {
+        size_t chunk = step && length - offset > step ? step : length - offset;
+        int fin = offset + chunk == length;
+        size_t header_len = ws_fragment_header_encode(header, offset ? WS_CONTINUATION : opcode, chunk, fin);
+        int result;
+
+        if (offset == 0) header[0] |= rsv;
+
+        if (direct) {
+            struct iovec iov[2];
+
+            iov[0].iov_base = header;
+            iov[0].iov_len = header_len;
+            iov[1].iov_base = (void*)(payload + offset);
+            iov[1].iov_len = chunk;
+            result = ws_client_write_all_locked(client, iov, 2);
+        } else {
+            result = ws_client_enqueue_locked(client, header, header_len, payload + offset, chunk,
+                                              ws_opcode_urgent(opcode));
+        }
+
+        if (result < 0) {
+            total = -1;
+            break;
+        }
+
+        total += header_len + chunk;
+        offset += chunk;
+
+        if (direct && !fin) {
+            ws_client_yield_locked(client);
+            if (client->state != WS_STATE_OPEN || ws_client_drain_locked(client, 1) < 0) {
+                total = -1;
+                break;
+            }
+        }
+    } while (offset < length);
+
+    if (direct) {
+        client->fragmenting = 0;
+        pthread_cond_broadcast(&client->writable);
+
+        // What other threads queued meanwhile; the connection's thread
+        // writes whatever the socket does not take now
+        if (ws_client_flush_locked(client) < 0) total = -1;
+    } else if (total >= 0 && ws_client_push_locked(client) < 0) {
+        total = -1;
+    }
+
+    return total;
+}
+
+// Run a message through the connection's extensions and write it.
+// Extension encoding and queuing happen under one lock so messages hit the
+// wire in the order stateful extensions (a shared deflate context) saw them.
+// Caller must hold client->mutex.
+static ssize_t ws_client_send_message_locked(ws_client_t *client, ws_opcode_t opcode, const uint8_t *payload,
+                                             size_t length) {
+    uint8_t *encoded = NULL;
+    size_t encoded_len;
+    uint8_t rsv = 0;
+    ssize_t result = -1;
+
+    int encoding = client->extension_count == 0 ? 0 :
+                   ws_extensions_encode_locked(client, opcode, payload, length, &encoded, &encoded_len, &rsv);
+    if (encoding > 0) {
+        payload = encoded;
+        length = encoded_len;
+    }
+
+    if (encoding >= 0) {
+        result = ws_client_write_message_locked(client, opcode, rsv, payload, length,
+                                                ws_client_fragment_size(client, opcode, length));
+    }
+
+    ws_pool_free(encoded);
+    return result;
+}
+
+// Send a message; with a generation, only if the slot still holds that
+// connection once we have its lock
+int ws_client_send_frame_to(ws_client_t *client, uint32_t generation, ws_opcode_t opcode,
+                            const uint8_t *payload, size_t length) {
+    if (!client || !client->connected || client->state != WS_STATE_OPEN) return -1;
+
+    ssize_t result = -1;
+
+    if (opcode & 0x08) {
+        ws_client_lock_control(client);
+    } else {
+        pthread_mutex_lock(&client->mutex);
+    }
+
+    // No data frame may follow our close frame (RFC 6455 section 5.5.1)
+    int open = client->state == WS_STATE_OPEN || (opcode & 0x08 && client->state != WS_STATE_CLOSED);
+    if (open && (!generation || client->generation == generation)) {
+        result = ws_client_send_message_locked(client, opcode, payload, length);
+    }
+
+    // Resume a fragment writer that paused for us
+    if (opcode & 0x08 && client->fragmenting) {
+        pthread_cond_broadcast(&client->writable);
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    if (result < 0) return -1;
+    return result > INT_MAX ? INT_MAX : (int)result;
+}
+
+int ws_client_send_frame(ws_client_t *client, ws_opcode_t opcode, const uint8_t *payload, size_t length) {
+    return ws_client_send_frame_to(client, 0, opcode, payload, length);
+}
+
+// Server-side push by connection id; -1 if that connection is gone
+int ws_server_send_to(ws_server_t *server, ws_client_id_t id, ws_opcode_t opcode, const uint8_t *payload,
+                      size_t length) {
+    return ws_client_send_frame_to(ws_server_find_client(server, id), (uint32_t)(id >> 32), opcode, payload, length);
+}
+
+// Queue shared (already encoded) frames of one message without copying them;
+// with a generation, only to the connection it names
+int ws_client_send_shared_frames_to(ws_client_t *client, uint32_t generation, ws_shared_buffer_t **frames,
+                                    size_t count) {
+    if (!client || !client->connected || client->state != WS_STATE_OPEN) return -1;
+
+    size_t total = 0;
+    int result = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        total += frames[i]->length;
+    }
+    int direct = ws_client_writes_direct(client, total);
+    int corking = ws_client_corking(client, total);
+
+    pthread_mutex_lock(&client->mutex);
+
+    // The owning worker may have closed the socket since the caller looked
+    if (client->state != WS_STATE_OPEN || (generation && client->generation != generation)) {
+        pthread_mutex_unlock(&client->mutex);
+        return -1;
+    }
+
+    if (direct) {
+        result = ws_client_drain_locked(client, 0) < 0 ? -1 : 0;
+        client->fragmenting = 1;
+    } else {
+        result = ws_client_reserve_locked(client, total, 0);
+    }
+
+    for (size_t i = 0; result == 0 && i < count; i++) {
+        struct iovec iov;
+        struct iovec *pending = &iov;
+        int iovcnt = 1;
+
+        iov.iov_base = frames[i]->data;
+        iov.iov_len = frames[i]->length;
+
+        if (direct) {
+            result = ws_client_write_all_locked(client, &iov, 1);
+        } else {
+            // Write what fits unless something is ahead of it, queue the rest
+            if (client->write_queue.count == 0 && !client->fragmenting && !corking) {
+                result = ws_sendv(client->socket, &pending, &iovcnt, MSG_DONTWAIT) < 0 ? -1 : 0;
+            }
+
+            if (result == 0 && iovcnt > 0) {
+                size_t offset = frames[i]->length - pending->iov_len;
+                result = ws_write_queue_push(&client->write_queue, frames[i], offset);
+
+                if (client->write_queue.bytes >= client->server->write_high_watermark) {
+                    client->write_blocked = 1;
+                }
+            }
+        }
+
+        if (direct && i + 1 < count) {
+            ws_client_yield_locked(client);
+            if (client->state != WS_STATE_OPEN || ws_client_drain_locked(client, 1) < 0) result = -1;
+        }
+    }
+
+    if (direct) {
+        client->fragmenting = 0;
+        pthread_cond_broadcast(&client->writable);
+        if (result == 0 && ws_client_flush_locked(client) < 0) result = -1;
+    } else if (corking && result == 0) {
+        result = ws_client_push_locked(client);
+    } else if (result == 0 && client->write_queue.count > 0 && !client->fragmenting) {
+        ws_client_wake_locked(client);
+    }
+
+    pthread_mutex_unlock(&client->mutex);
+    return result;
+}
+
+int ws_client_send_shared_frames(ws_client_t *client, ws_shared_buffer_t **frames, size_t count) {
+    return ws_client_send_shared_frames_to(client, 0, frames, count);
+}
+
+// Queue a shared (already encoded) buffer without copying it
+int ws_client_send_shared(ws_client_t *client, ws_shared_buffer_t *buffer) {
+    return ws_client_send_shared_frames(client, &buffer, 1);
+}
+
+// Returns 1 while the client's queue is below the high watermark
+int ws_client_writable(ws_client_t *client) {
+    return client && !client->write_blocked;
+}
+
+// Bytes accepted by the send API but not yet written to the socket
+size_t ws_client_buffered_amount(ws_client_t *client) {
+    if (!client) return 0;
+
+    pthread_mutex_lock(&client->mutex);
+    size_t bytes = client->write_queue.bytes;
+    pthread_mutex_unlock(&client->mutex);
+
+    return bytes;
+}
+
+int ws_client_send_text(ws_client_t *client, const char *message) {
+    return ws_client_send_frame(client, WS_TEXT, (uint8_t*)message, strlen(message));
+}
+
+int ws_client_send_binary(ws_client_t *client, const uint8_t *data, size_t length) {
+    return ws_client_send_frame(client, WS_BINARY, data, length);
+}
+
+int ws_client_send_close(ws_client_t *client, uint16_t code, const char *reason) {
+    if (!client || !client->connected || client->state != WS_STATE_OPEN) return -1;
+
+    uint8_t payload[125];
+    size_t payload_len = ws_close_payload(payload, code, reason);
+    ssize_t result = -1;
+
+    // The close frame goes out and the state leaves OPEN under one hold, so
+    // another thread cannot queue data behind it
+    ws_client_lock_control(client);
+    if (client->state == WS_STATE_OPEN) {
+        result = ws_client_send_message_locked(client, WS_CLOSE, payload, payload_len);
+
+        int timeout = client->server->close_timeout_ms;
+        client->close_deadline = timeout > 0 ? ws_monotonic_ms() + timeout : 0;
+        client->state = WS_STATE_CLOSING;
+
+        // The owning worker arms the close deadline
+        if (client->worker && !ws_client_on_owner_thread(client)) {
+            ws_event_loop_notify_locked(client);
+        }
+    }
+
+    // Resume a fragment writer that paused for us
+    if (client->fragmenting) {
+        pthread_cond_broadcast(&client->writable);
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    return result;
+}
@@ -0,0 +1,107 @@
+#include "websocket.h"
+
+// SHA-1 (FIPS 180-4), used only to derive Sec-WebSocket-Accept. The key and
+// the GUID together are 60 bytes, so an accept key is two compressions on a
+// stack context: no heap, no library state.
+
+#define WS_SHA1_ROL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+static void ws_sha1_block(uint32_t state[5], const uint8_t block[64]) {
+    uint32_t w[80];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = WS_SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        uint32_t temp = WS_SHA1_ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = WS_SHA1_ROL(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void ws_sha1_init(ws_sha1_t *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->length = 0;
+}
+
+void ws_sha1_update(ws_sha1_t *ctx, const uint8_t *data, size_t length) {
+    size_t used = ctx->length & 63;
+
+    ctx->length += length;
+
+    if (used > 0) {
+        size_t take = 64 - used < length ? 64 - used : length;
+        memcpy(ctx->block + used, data, take);
+        data += take;
+        length -= take;
+        if (used + take < 64) return;
+        ws_sha1_block(ctx->state, ctx->block);
+    }
+
+    for (; length >= 64; data += 64, length -= 64) {
+        ws_sha1_block(ctx->state, data);
+    }
+
+    memcpy(ctx->block, data, length);
+}
+
+void ws_sha1_final(ws_sha1_t *ctx, uint8_t digest[WS_SHA1_DIGEST_SIZE]) {
+    uint64_t bits = ctx->length * 8;
+    size_t used = ctx->length & 63;
+
+    // Pad with 0x80, zeros, then the message length in bits, big-endian
+    ctx->block[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->block + used, 0, 64 - used);
+        ws_sha1_block(ctx->state, ctx->block);
+        used = 0;
+    }
+    memset(ctx->block + used, 0, 56 - used);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    ws_sha1_block(ctx->state, ctx->block);
+
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
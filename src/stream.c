@@ -7,6 +7,7 @@ typedef struct ws_stream {
     pthread_mutex_t read_mutex;
     pthread_mutex_t write_mutex;
     int non_blocking;
+    size_t max_buffered;
 } ws_stream_t;
 
 ws_stream_t* ws_stream_create(int socket) {
@@ -17,6 +18,7 @@ ws_stream_t* ws_stream_create(int socket) {
     stream->read_buffer = ws_buffer_create(BUFFER_SIZE);
     stream->write_buffer = ws_buffer_create(BUFFER_SIZE);
     stream->non_blocking = 0;
+    stream->max_buffered = WS_DEFAULT_HIGH_WATERMARK;
 
     if (!stream->read_buffer || !stream->write_buffer) {
         ws_buffer_destroy(stream->read_buffer);
@@ -83,24 +85,47 @@ int ws_stream_read(ws_stream_t *stream, uint8_t *buffer, size_t size) {
     return result;
 }
 
-int ws_stream_write(ws_stream_t *stream, const uint8_t *buffer, size_t size) {
+// Cap the bytes ws_stream_write may hold back on EAGAIN
+int ws_stream_set_max_buffered(ws_stream_t *stream, size_t max_buffered) {
     if (!stream) return -1;
 
     pthread_mutex_lock(&stream->write_mutex);
+    stream->max_buffered = max_buffered;
+    pthread_mutex_unlock(&stream->write_mutex);
 
-    // Try to send directly first
-    int sent = send(stream->socket, buffer, size, MSG_NOSIGNAL);
+    return 0;
+}
 
-    if (sent == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // Buffer the data
-            if (ws_buffer_append(stream->write_buffer, buffer, size) == 0) {
-                sent = size; // Indicate success, data buffered
+int ws_stream_write(ws_stream_t *stream, const uint8_t *buffer, size_t size) {
+    if (!stream) return -1;
+
+    pthread_mutex_lock(&stream->write_mutex);
+
+    // Keep ordering: nothing goes out directly while older data is buffered
+    ssize_t sent = 0;
+    if (stream->write_buffer->size == 0) {
+        sent = send(stream->socket, buffer, size, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                pthread_mutex_unlock(&stream->write_mutex);
+                return -1;
             }
+            sent = 0;
+        }
+    }
+
+    if ((size_t)sent < size) {
+        // Buffer the remainder, but never beyond max_buffered
+        size_t remaining = size - sent;
+        if (stream->write_buffer->size + remaining > stream->max_buffered) {
+            pthread_mutex_unlock(&stream->write_mutex);
+            errno = ENOBUFS;
+            return sent > 0 ? (int)sent : -1;
+        }
+
+        if (ws_buffer_append(stream->write_buffer, buffer + sent, remaining) == 0) {
+            sent = size; // Indicate success, data buffered
         }
-    } else if (sent < size) {
-        // Partially sent, buffer remaining
-        ws_buffer_append(stream->write_buffer, buffer + sent, size - sent);
     }
 
     pthread_mutex_unlock(&stream->write_mutex);
@@ -0,0 +1,184 @@
+#include "websocket.h"
+
+// Hierarchical timing wheel (Varghese & Lauck, as in the classic Linux
+// timer code). Four levels of 64 slots at 10 ms per tick reach about 46
+// hours; anything further is parked in the last level and re-filed when it
+// comes round. Timers are intrusive and doubly linked, so arming and
+// cancelling are O(1). A timer in a higher level is moved down once per
+// level as its time approaches, so each one costs a few list moves in
+// total and nothing while it waits.
+
+#define WS_TIMER_SLOT_BITS 6
+#define WS_TIMER_SLOT_MASK (WS_TIMER_SLOTS - 1)
+#define WS_TIMER_MAX_TICKS ((uint64_t)1 << (WS_TIMER_SLOT_BITS * WS_TIMER_LEVELS))
+
+void ws_timer_wheel_init(ws_timer_wheel_t *wheel, uint64_t now_ms) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->current = now_ms / WS_TIMER_TICK_MS;
+}
+
+void ws_timer_init(ws_timer_t *timer, void (*callback)(void *ctx), void *ctx) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->ctx = ctx;
+}
+
+// File the timer in the slot its tick falls in, relative to now
+static void ws_timer_link(ws_timer_wheel_t *wheel, ws_timer_t *timer) {
+    uint64_t expires = timer->expires > wheel->current ? timer->expires : wheel->current + 1;
+    uint64_t delta = expires - wheel->current;
+    int level = 0;
+
+    if (delta >= WS_TIMER_MAX_TICKS) {
+        expires = wheel->current + WS_TIMER_MAX_TICKS - 1;
+        delta = WS_TIMER_MAX_TICKS - 1;
+    }
+    while (delta >= (uint64_t)1 << (WS_TIMER_SLOT_BITS * (level + 1))) {
+        level++;
+    }
+
+    int slot = (expires >> (WS_TIMER_SLOT_BITS * level)) & WS_TIMER_SLOT_MASK;
+    ws_timer_t **head = &wheel->slots[level][slot];
+
+    timer->slot = level * WS_TIMER_SLOTS + slot;
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+    wheel->count++;
+}
+
+static void ws_timer_unlink(ws_timer_wheel_t *wheel, ws_timer_t *timer) {
+    int level = timer->slot / WS_TIMER_SLOTS;
+    int slot = timer->slot % WS_TIMER_SLOTS;
+
+    if (timer->next) timer->next->pprev = timer->pprev;
+    *timer->pprev = timer->next;
+
+    if (!wheel->slots[level][slot]) {
+        wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    }
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+// Fire callback at or after deadline_ms; re-arms a pending timer
+void ws_timer_arm(ws_timer_wheel_t *wheel, ws_timer_t *timer, uint64_t deadline_ms) {
+    if (timer->pprev) ws_timer_unlink(wheel, timer);
+
+    timer->expires = (deadline_ms + WS_TIMER_TICK_MS - 1) / WS_TIMER_TICK_MS;
+    ws_timer_link(wheel, timer);
+}
+
+void ws_timer_cancel(ws_timer_wheel_t *wheel, ws_timer_t *timer) {
+    if (timer->pprev) ws_timer_unlink(wheel, timer);
+}
+
+int ws_timer_pending(const ws_timer_t *timer) {
+    return timer->pprev != NULL;
+}
+
+// Take a slot's list onto a local head. Unlinking from it then works as
+// usual, so callbacks may cancel timers that have not run yet.
+static void ws_timer_detach(ws_timer_wheel_t *wheel, int level, int slot, ws_timer_t **list) {
+    *list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    if (*list) (*list)->pprev = list;
+}
+
+// Move a higher level's slot down now that its time is near
+static void ws_timer_cascade(ws_timer_wheel_t *wheel, int level, int slot) {
+    ws_timer_t *list;
+
+    ws_timer_detach(wheel, level, slot, &list);
+    while (list) {
+        ws_timer_t *timer = list;
+        ws_timer_unlink(wheel, timer);
+        ws_timer_link(wheel, timer);
+    }
+}
+
+// Run every timer due by now_ms
+void ws_timer_wheel_advance(ws_timer_wheel_t *wheel, uint64_t now_ms) {
+    uint64_t target = now_ms / WS_TIMER_TICK_MS;
+
+    while (wheel->current < target) {
+        if (wheel->count == 0) {
+            wheel->current = target;
+            break;
+        }
+
+        // Nothing in the first level: skip to the next cascade
+        if (!wheel->occupied[0]) {
+            uint64_t boundary = wheel->current | WS_TIMER_SLOT_MASK;
+            if (boundary >= target) {
+                wheel->current = target;
+                break;
+            }
+            wheel->current = boundary;
+        }
+
+        wheel->current++;
+
+        int level = 0;
+        int slot = wheel->current & WS_TIMER_SLOT_MASK;
+        while (slot == 0 && ++level < WS_TIMER_LEVELS) {
+            slot = (wheel->current >> (WS_TIMER_SLOT_BITS * level)) & WS_TIMER_SLOT_MASK;
+            ws_timer_cascade(wheel, level, slot);
+        }
+
+        ws_timer_t *list;
+        ws_timer_detach(wheel, 0, wheel->current & WS_TIMER_SLOT_MASK, &list);
+        while (list) {
+            ws_timer_t *timer = list;
+            ws_timer_unlink(wheel, timer);
+
+            // Parked past the wheel's reach; file it again
+            if (timer->expires > wheel->current) {
+                ws_timer_link(wheel, timer);
+                continue;
+            }
+
+            timer->callback(timer->ctx);
+        }
+    }
+}
+
+// Slots from the one after index, wrapping: distance to the first occupied
+// one (1..64), or 0 if none is
+static int ws_timer_next_slot(uint64_t occupied, int index) {
+    if (!occupied) return 0;
+
+    int shift = (index + 1) & WS_TIMER_SLOT_MASK;
+    uint64_t rotated = shift ? (occupied >> shift) | (occupied << (WS_TIMER_SLOTS - shift)) : occupied;
+    return __builtin_ctzll(rotated) + 1;
+}
+
+// Milliseconds until the wheel next needs advancing, -1 if it is empty.
+// For a higher level that is when its next slot cascades, which is never
+// later than the timers in it.
+int ws_timer_wheel_timeout(const ws_timer_wheel_t *wheel, uint64_t now_ms) {
+    if (wheel->count == 0) return -1;
+
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < WS_TIMER_LEVELS; level++) {
+        int shift = WS_TIMER_SLOT_BITS * level;
+        int distance = ws_timer_next_slot(wheel->occupied[level], (wheel->current >> shift) & WS_TIMER_SLOT_MASK);
+        if (!distance) continue;
+
+        uint64_t tick = ((wheel->current >> shift) + distance) << shift;
+        if (tick < next) next = tick;
+    }
+
+    uint64_t next_ms = next * WS_TIMER_TICK_MS;
+    if (next_ms <= now_ms) return 0;
+    return next_ms - now_ms > INT_MAX ? INT_MAX : (int)(next_ms - now_ms);
+}
@@ -0,0 +1,354 @@
+#include "websocket.h"
+
+// Topic subscriptions
+//
+// Topics are indexed per shard: one per event loop worker in WS_MODE_EPOLL,
+// WS_TOPIC_SHARDS picked by slot number in the threaded model. All of a
+// connection's subscriptions live in its own shard, so subscribing, leaving
+// and closing lock only that shard, and workers never contend with each
+// other. A shard maps topic names to a dense array of members; a member and
+// the connection's matching subscription record each other's position, so
+// either side is removed by moving the last entry into its place.
+// Publishing encodes the message once and visits the shards in turn: it
+// copies a topic's members out under the shard's lock and queues the frames
+// after dropping it, so a slow subscriber never holds up the shard.
+
+#define WS_TOPIC_BUCKETS 64             // Initial buckets per shard; doubles as topics are added
+#define WS_SUBSCRIPTIONS_KEEP 16        // A closed connection keeps a list this small for the next one
+
+typedef struct {
+    ws_client_t *client;
+    uint32_t subscription;      // Position in the client's subscriptions
+} ws_topic_member_t;
+
+typedef struct ws_topic {
+    struct ws_topic *next;      // Hash chain
+    uint64_t hash;
+    ws_topic_member_t *members;
+    uint32_t count;
+    uint32_t capacity;
+    char name[];
+} ws_topic_t;
+
+// A member as publish saw it, so a connection that closes meanwhile is skipped
+typedef struct {
+    ws_client_t *client;
+    uint32_t generation;
+} ws_topic_target_t;
+
+// FNV-1a
+static uint64_t ws_topic_hash(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t)*name) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int ws_server_topics_init(ws_server_t *server, int shards) {
+    server->topics = calloc(shards, sizeof(ws_topic_shard_t));
+    if (!server->topics) return -1;
+
+    for (int i = 0; i < shards; i++) {
+        ws_topic_shard_t *shard = &server->topics[i];
+
+        shard->buckets = calloc(WS_TOPIC_BUCKETS, sizeof(ws_topic_t*));
+        if (!shard->buckets) {
+            server->topic_shard_count = i;
+            ws_server_topics_destroy(server);
+            return -1;
+        }
+        shard->bucket_count = WS_TOPIC_BUCKETS;
+        pthread_mutex_init(&shard->mutex, NULL);
+    }
+
+    server->topic_shard_count = shards;
+    return 0;
+}
+
+// Connection lists are freed with the client table
+void ws_server_topics_destroy(ws_server_t *server) {
+    if (!server->topics) return;
+
+    for (int i = 0; i < server->topic_shard_count; i++) {
+        ws_topic_shard_t *shard = &server->topics[i];
+
+        for (size_t b = 0; b < shard->bucket_count; b++) {
+            ws_topic_t *topic = shard->buckets[b];
+            while (topic) {
+                ws_topic_t *next = topic->next;
+                free(topic->members);
+                free(topic);
+                topic = next;
+            }
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+
+    free(server->topics);
+    server->topics = NULL;
+    server->topic_shard_count = 0;
+}
+
+static ws_topic_shard_t* ws_topic_shard_of(ws_client_t *client) {
+    ws_server_t *server = client->server;
+    int index = client->worker ? client->worker->index : (int)(client->slot % WS_TOPIC_SHARDS);
+
+    return &server->topics[index];
+}
+
+// The link holding the named topic, or the empty one at the end of its chain
+static ws_topic_t** ws_topic_find(ws_topic_shard_t *shard, const char *name, uint64_t hash) {
+    ws_topic_t **link = &shard->buckets[hash & (shard->bucket_count - 1)];
+
+    while (*link && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Double the buckets; if that fails chains just get longer
+static void ws_topic_shard_grow(ws_topic_shard_t *shard) {
+    size_t count = shard->bucket_count * 2;
+    ws_topic_t **buckets = calloc(count, sizeof(ws_topic_t*));
+    if (!buckets) return;
+
+    for (size_t b = 0; b < shard->bucket_count; b++) {
+        ws_topic_t *topic = shard->buckets[b];
+        while (topic) {
+            ws_topic_t *next = topic->next;
+            ws_topic_t **link = &buckets[topic->hash & (count - 1)];
+            topic->next = *link;
+            *link = topic;
+            topic = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = count;
+}
+
+// Make room for one more element of a growable array
+static int ws_topic_reserve(void **array, uint32_t *capacity, uint32_t count, size_t size) {
+    if (count < *capacity) return 0;
+
+    uint32_t grown = *capacity ? *capacity * 2 : 4;
+    void *resized = realloc(*array, grown * size);
+    if (!resized) return -1;
+
+    *array = resized;
+    *capacity = grown;
+    return 0;
+}
+
+static void ws_topic_remove(ws_topic_shard_t *shard, ws_topic_t *topic) {
+    ws_topic_t **link = &shard->buckets[topic->hash & (shard->bucket_count - 1)];
+
+    while (*link != topic) {
+        link = &(*link)->next;
+    }
+    *link = topic->next;
+    shard->topic_count--;
+
+    free(topic->members);
+    free(topic);
+}
+
+static int ws_topic_subscribe_locked(ws_topic_shard_t *shard, ws_client_t *client, const char *name,
+                                     uint64_t hash) {
+    ws_topic_t **link = ws_topic_find(shard, name, hash);
+    ws_topic_t *topic = *link;
+
+    if (topic) {
+        for (uint32_t i = 0; i < client->subscription_count; i++) {
+            if (client->subscriptions[i].topic == topic) return 0;
+        }
+    }
+
+    if (ws_topic_reserve((void**)&client->subscriptions, &client->subscription_capacity,
+                         client->subscription_count, sizeof(ws_subscription_t)) < 0) {
+        return -1;
+    }
+
+    if (!topic) {
+        size_t length = strlen(name);
+
+        topic = malloc(sizeof(ws_topic_t) + length + 1);
+        if (!topic) return -1;
+
+        topic->next = NULL;
+        topic->hash = hash;
+        topic->members = NULL;
+        topic->count = 0;
+        topic->capacity = 0;
+        memcpy(topic->name, name, length + 1);
+    }
+
+    if (ws_topic_reserve((void**)&topic->members, &topic->capacity, topic->count, sizeof(ws_topic_member_t)) < 0) {
+        if (!*link) free(topic);
+        return -1;
+    }
+
+    uint32_t member = topic->count++;
+    uint32_t subscription = client->subscription_count++;
+    topic->members[member] = (ws_topic_member_t){ client, subscription };
+    client->subscriptions[subscription] = (ws_subscription_t){ topic, member };
+
+    if (!*link) {
+        *link = topic;
+        if (++shard->topic_count > shard->bucket_count) ws_topic_shard_grow(shard);
+    }
+    return 0;
+}
+
+// Drop the client's subscription at index; each side fills the hole with its last entry
+static void ws_topic_unsubscribe_locked(ws_topic_shard_t *shard, ws_client_t *client, uint32_t index) {
+    ws_topic_t *topic = client->subscriptions[index].topic;
+    uint32_t member = client->subscriptions[index].member;
+
+    ws_topic_member_t *last = &topic->members[--topic->count];
+    if (member != topic->count) {
+        topic->members[member] = *last;
+        last->client->subscriptions[last->subscription].member = member;
+    }
+
+    ws_subscription_t *tail = &client->subscriptions[--client->subscription_count];
+    if (index != client->subscription_count) {
+        client->subscriptions[index] = *tail;
+        tail->topic->members[tail->member].subscription = index;
+    }
+
+    if (topic->count == 0) {
+        ws_topic_remove(shard, topic);
+    } else if (topic->capacity > 64 && topic->count < topic->capacity / 4) {
+        // Keep member arrays compact after a room empties out
+        ws_topic_member_t *members = realloc(topic->members, topic->capacity / 2 * sizeof(ws_topic_member_t));
+        if (members) {
+            topic->members = members;
+            topic->capacity /= 2;
+        }
+    }
+}
+
+// Subscribe an open connection to a topic. Returns 0, also when it already
+// was, or -1.
+int ws_server_subscribe(ws_client_t *client, const char *topic) {
+    if (!client || !topic || !client->server->topics) return -1;
+
+    uint64_t hash = ws_topic_hash(topic);
+    ws_topic_shard_t *shard = ws_topic_shard_of(client);
+    int result = -1;
+
+    // The close path unsubscribes under this lock after leaving OPEN, so a
+    // subscription cannot outlive the connection
+    pthread_mutex_lock(&shard->mutex);
+    if (client->connected && client->state == WS_STATE_OPEN) {
+        result = ws_topic_subscribe_locked(shard, client, topic, hash);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return result;
+}
+
+// Returns 0, or -1 if the connection was not subscribed
+int ws_server_unsubscribe(ws_client_t *client, const char *topic) {
+    if (!client || !topic || !client->server->topics) return -1;
+
+    uint64_t hash = ws_topic_hash(topic);
+    ws_topic_shard_t *shard = ws_topic_shard_of(client);
+    int result = -1;
+
+    pthread_mutex_lock(&shard->mutex);
+    for (uint32_t i = 0; i < client->subscription_count; i++) {
+        ws_topic_t *subscribed = client->subscriptions[i].topic;
+
+        if (subscribed->hash == hash && strcmp(subscribed->name, topic) == 0) {
+            ws_topic_unsubscribe_locked(shard, client, i);
+            result = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return result;
+}
+
+// Called as a connection closes
+void ws_client_unsubscribe_all(ws_client_t *client) {
+    if (!client->server->topics) return;
+
+    ws_topic_shard_t *shard = ws_topic_shard_of(client);
+
+    pthread_mutex_lock(&shard->mutex);
+    while (client->subscription_count > 0) {
+        ws_topic_unsubscribe_locked(shard, client, client->subscription_count - 1);
+    }
+
+    if (client->subscription_capacity > WS_SUBSCRIPTIONS_KEEP) {
+        free(client->subscriptions);
+        client->subscriptions = NULL;
+        client->subscription_capacity = 0;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// Queue a message to every connection subscribed to the topic. It is encoded
+// (and compressed, where clients can share that) once, on finding the first
+// subscriber. Returns the number of connections it was queued to, or -1.
+int ws_server_publish(ws_server_t *server, const char *topic, ws_opcode_t opcode, const uint8_t *data,
+                      size_t length) {
+    if (!server || !topic || !server->topics) return -1;
+
+    uint64_t hash = ws_topic_hash(topic);
+    ws_broadcast_t broadcast;
+    int encoded = 0;
+    int result = 0;
+    ws_topic_target_t *targets = NULL;
+    size_t capacity = 0;
+
+    for (int s = 0; s < server->topic_shard_count && result == 0; s++) {
+        ws_topic_shard_t *shard = &server->topics[s];
+        size_t count = 0;
+
+        pthread_mutex_lock(&shard->mutex);
+        ws_topic_t *found = *ws_topic_find(shard, topic, hash);
+
+        if (found && found->count > capacity) {
+            ws_pool_free(targets);
+            targets = ws_pool_alloc(found->count * sizeof(ws_topic_target_t));
+            capacity = targets ? found->count : 0;
+            if (!targets) result = -1;
+        }
+
+        // Members stay connected while the lock is held, so their generation is current
+        for (uint32_t i = 0; found && result == 0 && i < found->count; i++) {
+            ws_client_t *client = found->members[i].client;
+            targets[count].client = client;
+            targets[count].generation = __atomic_load_n(&client->generation, __ATOMIC_RELAXED);
+            count++;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        if (count > 0 && !encoded) {
+            if (ws_broadcast_begin(&broadcast, server, opcode, data, length) < 0) {
+                result = -1;
+                break;
+            }
+            encoded = 1;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            ws_broadcast_send(&broadcast, targets[i].client, targets[i].generation);
+        }
+    }
+
+    ws_pool_free(targets);
+
+    if (!encoded) return result;
+
+    ws_broadcast_end(&broadcast);
+    return result < 0 ? -1 : broadcast.queued;
+}
@@ -1,43 +1,313 @@
 #include "websocket.h"
 
-int ws_validate_utf8(const uint8_t *data, size_t length) {
+// UTF-8 validation (RFC 3629, as required by RFC 6455 section 8.1)
+//
+// Overlong forms, UTF-16 surrogates and code points above U+10FFFF are
+// rejected. Pure-ASCII runs are skipped 8 or 16 bytes at a time; multibyte
+// text goes through the SIMD lookup-table classifier (Keiser & Lemire) when
+// the CPU has one, with the byte state machine below handling chunk edges.
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WS_UTF8_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define WS_UTF8_NEON 1
+#endif
+
+void ws_utf8_init(ws_utf8_state_t *state) {
+    state->needed = 0;
+    state->lower = 0x80;
+    state->upper = 0xBF;
+}
+
+// Advance the state machine by one byte; returns 0 on an invalid byte
+static inline int ws_utf8_step(ws_utf8_state_t *state, uint8_t byte) {
+    if (state->needed) {
+        if (byte < state->lower || byte > state->upper) return 0;
+        state->needed--;
+        state->lower = 0x80;
+        state->upper = 0xBF;
+        return 1;
+    }
+
+    // ASCII (0xxxxxxx)
+    if (byte < 0x80) return 1;
+
+    // 2-byte sequence (110xxxxx 10xxxxxx); C0 and C1 would be overlong
+    if (byte >= 0xC2 && byte <= 0xDF) {
+        state->needed = 1;
+    }
+    // 3-byte sequence (1110xxxx 10xxxxxx 10xxxxxx)
+    else if (byte >= 0xE0 && byte <= 0xEF) {
+        state->needed = 2;
+        if (byte == 0xE0) state->lower = 0xA0;  // Overlong
+        if (byte == 0xED) state->upper = 0x9F;  // Surrogates
+    }
+    // 4-byte sequence (11110xxx 10xxxxxx 10xxxxxx 10xxxxxx)
+    else if (byte >= 0xF0 && byte <= 0xF4) {
+        state->needed = 3;
+        if (byte == 0xF0) state->lower = 0x90;  // Overlong
+        if (byte == 0xF4) state->upper = 0x8F;  // Above U+10FFFF
+    }
+    else {
+        return 0; // Invalid start byte
+    }
+
+    return 1;
+}
+
+static int ws_utf8_scalar(ws_utf8_state_t *state, const uint8_t *data, size_t length) {
     size_t i = 0;
-    while (i < length) {
-        uint8_t byte = data[i];
-        int bytes_to_check = 0;
 
-        // ASCII (0xxxxxxx)
-        if ((byte & 0x80) == 0) {
-            bytes_to_check = 1;
-        }
-        // 2-byte sequence (110xxxxx 10xxxxxx)
-        else if ((byte & 0xE0) == 0xC0) {
-            bytes_to_check = 2;
-        }
-        // 3-byte sequence (1110xxxx 10xxxxxx 10xxxxxx)
-        else if ((byte & 0xF0) == 0xE0) {
-            bytes_to_check = 3;
-        }
-        // 4-byte sequence (11110xxx 10xxxxxx 10xxxxxx 10xxxxxx)
-        else if ((byte & 0xF8) == 0xF0) {
-            bytes_to_check = 4;
-        }
-        else {
-            return 0; // Invalid start byte
+    while (i < length) {
+        // Skip ASCII eight bytes at a time while between characters
+        if (!state->needed) {
+            while (i + 8 <= length) {
+                uint64_t word;
+                memcpy(&word, data + i, sizeof(word));
+                if (word & 0x8080808080808080ULL) break;
+                i += 8;
+            }
+            if (i == length) break;
         }
 
-        if (i + bytes_to_check > length) {
-            return 0; // Not enough bytes
+        if (!ws_utf8_step(state, data[i])) return 0;
+        i++;
+    }
+
+    return 1;
+}
+
+// Sequence length announced by a lead byte
+static inline size_t ws_utf8_lead_length(uint8_t byte) {
+    if (byte >= 0xF0) return 4;
+    if (byte >= 0xE0) return 3;
+    if (byte >= 0xC0) return 2;
+    return 1;
+}
+
+// Where the byte state machine must resume after a SIMD pass that stopped at
+// end: the start of a sequence cut off by the block boundary, or end itself.
+static size_t ws_utf8_resume_point(const uint8_t *data, size_t start, size_t end) {
+    for (size_t back = 1; back <= 3 && back <= end - start; back++) {
+        uint8_t byte = data[end - back];
+        if ((byte & 0xC0) == 0x80) continue;
+        if (ws_utf8_lead_length(byte) > back) return end - back;
+        break;
+    }
+
+    return end;
+}
+
+// Error bits for the lookup tables
+#define WS_UTF8_TOO_SHORT   (1 << 0)
+#define WS_UTF8_TOO_LONG    (1 << 1)
+#define WS_UTF8_OVERLONG_3  (1 << 2)
+#define WS_UTF8_TOO_LARGE   (1 << 3)
+#define WS_UTF8_SURROGATE   (1 << 4)
+#define WS_UTF8_OVERLONG_2  (1 << 5)
+#define WS_UTF8_TOO_LARGE_1000 (1 << 6)
+#define WS_UTF8_OVERLONG_4  (1 << 6)
+#define WS_UTF8_TWO_CONTS   (1 << 7)
+#define WS_UTF8_CARRY (WS_UTF8_TOO_SHORT | WS_UTF8_TOO_LONG | WS_UTF8_TWO_CONTS)
+
+// Indexed by the high nibble of the previous byte
+static const uint8_t ws_utf8_byte1_high[16] = {
+    WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG,
+    WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG,
+    WS_UTF8_TWO_CONTS, WS_UTF8_TWO_CONTS, WS_UTF8_TWO_CONTS, WS_UTF8_TWO_CONTS,
+    WS_UTF8_TOO_SHORT | WS_UTF8_OVERLONG_2,
+    WS_UTF8_TOO_SHORT,
+    WS_UTF8_TOO_SHORT | WS_UTF8_OVERLONG_3 | WS_UTF8_SURROGATE,
+    WS_UTF8_TOO_SHORT | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000 | WS_UTF8_OVERLONG_4
+};
+
+// Indexed by the low nibble of the previous byte
+static const uint8_t ws_utf8_byte1_low[16] = {
+    WS_UTF8_CARRY | WS_UTF8_OVERLONG_3 | WS_UTF8_OVERLONG_2 | WS_UTF8_OVERLONG_4,
+    WS_UTF8_CARRY | WS_UTF8_OVERLONG_2,
+    WS_UTF8_CARRY,
+    WS_UTF8_CARRY,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000 | WS_UTF8_SURROGATE,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000
+};
+
+// Indexed by the high nibble of the current byte
+static const uint8_t ws_utf8_byte2_high[16] = {
+    WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT,
+    WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT,
+    WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS | WS_UTF8_OVERLONG_3 |
+        WS_UTF8_TOO_LARGE_1000 | WS_UTF8_OVERLONG_4,
+    WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS | WS_UTF8_OVERLONG_3 | WS_UTF8_TOO_LARGE,
+    WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS | WS_UTF8_SURROGATE | WS_UTF8_TOO_LARGE,
+    WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS | WS_UTF8_SURROGATE | WS_UTF8_TOO_LARGE,
+    WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT
+};
+
+// Bytes that would leave a sequence unfinished in the last three positions
+static const uint8_t ws_utf8_incomplete_max[16] = {
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+
+// Validate the whole 16-byte blocks of data, starting between characters.
+// Returns the number of bytes covered, or -1 on invalid input.
+typedef long (*ws_utf8_simd_fn)(const uint8_t *data, size_t length);
+
+#ifdef WS_UTF8_X86
+__attribute__((target("ssse3")))
+static long ws_utf8_ssse3(const uint8_t *data, size_t length) {
+    const __m128i byte1_high = _mm_loadu_si128((const __m128i*)ws_utf8_byte1_high);
+    const __m128i byte1_low = _mm_loadu_si128((const __m128i*)ws_utf8_byte1_low);
+    const __m128i byte2_high = _mm_loadu_si128((const __m128i*)ws_utf8_byte2_high);
+    const __m128i incomplete_max = _mm_loadu_si128((const __m128i*)ws_utf8_incomplete_max);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i third_byte = _mm_set1_epi8((char)(0xE0 - 0x80));
+    const __m128i fourth_byte = _mm_set1_epi8((char)(0xF0 - 0x80));
+    const __m128i high_bit = _mm_set1_epi8((char)0x80);
+
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i input = _mm_loadu_si128((const __m128i*)(data + i));
+
+        if (_mm_movemask_epi8(input) == 0) {
+            // ASCII block: only an unfinished sequence before it can be wrong
+            error = _mm_or_si128(error, prev_incomplete);
+        } else {
+            __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+            __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+            __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+
+            __m128i special = _mm_and_si128(
+                _mm_and_si128(
+                    _mm_shuffle_epi8(byte1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                    _mm_shuffle_epi8(byte1_low, _mm_and_si128(prev1, nibble))),
+                _mm_shuffle_epi8(byte2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+            // Third and fourth bytes of 3- and 4-byte sequences must be continuations
+            __m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, third_byte), _mm_subs_epu8(prev3, fourth_byte));
+            error = _mm_or_si128(error, _mm_xor_si128(_mm_and_si128(must23, high_bit), special));
+
+            prev_incomplete = _mm_subs_epu8(input, incomplete_max);
         }
 
-        // Check continuation bytes
-        for (int j = 1; j < bytes_to_check; j++) {
-            if ((data[i + j] & 0xC0) != 0x80) {
-                return 0; // Invalid continuation byte
-            }
+        prev_input = input;
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) return -1;
+    }
+
+    return (long)i;
+}
+#endif
+
+#ifdef WS_UTF8_NEON
+static long ws_utf8_neon(const uint8_t *data, size_t length) {
+    const uint8x16_t byte1_high = vld1q_u8(ws_utf8_byte1_high);
+    const uint8x16_t byte1_low = vld1q_u8(ws_utf8_byte1_low);
+    const uint8x16_t byte2_high = vld1q_u8(ws_utf8_byte2_high);
+    const uint8x16_t incomplete_max = vld1q_u8(ws_utf8_incomplete_max);
+    const uint8x16_t nibble = vdupq_n_u8(0x0F);
+    const uint8x16_t third_byte = vdupq_n_u8(0xE0 - 0x80);
+    const uint8x16_t fourth_byte = vdupq_n_u8(0xF0 - 0x80);
+    const uint8x16_t high_bit = vdupq_n_u8(0x80);
+
+    uint8x16_t prev_input = vdupq_n_u8(0);
+    uint8x16_t prev_incomplete = vdupq_n_u8(0);
+    uint8x16_t error = vdupq_n_u8(0);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t input = vld1q_u8(data + i);
+
+        if (vmaxvq_u8(input) < 0x80) {
+            // ASCII block: only an unfinished sequence before it can be wrong
+            error = vorrq_u8(error, prev_incomplete);
+        } else {
+            uint8x16_t prev1 = vextq_u8(prev_input, input, 15);
+            uint8x16_t prev2 = vextq_u8(prev_input, input, 14);
+            uint8x16_t prev3 = vextq_u8(prev_input, input, 13);
+
+            uint8x16_t special = vandq_u8(
+                vandq_u8(vqtbl1q_u8(byte1_high, vshrq_n_u8(prev1, 4)),
+                         vqtbl1q_u8(byte1_low, vandq_u8(prev1, nibble))),
+                vqtbl1q_u8(byte2_high, vshrq_n_u8(input, 4)));
+
+            // Third and fourth bytes of 3- and 4-byte sequences must be continuations
+            uint8x16_t must23 = vorrq_u8(vqsubq_u8(prev2, third_byte), vqsubq_u8(prev3, fourth_byte));
+            error = vorrq_u8(error, veorq_u8(vandq_u8(must23, high_bit), special));
+
+            prev_incomplete = vqsubq_u8(input, incomplete_max);
         }
 
-        i += bytes_to_check;
+        prev_input = input;
+
+        if (vmaxvq_u8(error) != 0) return -1;
     }
-    return 1; // Valid UTF-8
+
+    return (long)i;
+}
+#endif
+
+static ws_utf8_simd_fn ws_utf8_simd = NULL;
+static pthread_once_t ws_utf8_once = PTHREAD_ONCE_INIT;
+
+static void ws_utf8_select(void) {
+#ifdef WS_UTF8_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        ws_utf8_simd = ws_utf8_ssse3;
+    }
+#elif defined(WS_UTF8_NEON)
+    ws_utf8_simd = ws_utf8_neon;
+#endif
+}
+
+// Validate the next chunk of a (possibly fragmented) text message.
+// Returns 1 if the bytes so far are valid UTF-8, possibly ending mid-character;
+// call ws_utf8_finish() at the end of the message.
+int ws_utf8_validate_chunk(ws_utf8_state_t *state, const uint8_t *data, size_t length) {
+    size_t i = 0;
+
+    // Finish a character left open by the previous chunk
+    while (state->needed && i < length) {
+        if (!ws_utf8_step(state, data[i])) return 0;
+        i++;
+    }
+
+    pthread_once(&ws_utf8_once, ws_utf8_select);
+
+    if (ws_utf8_simd && length - i >= 16) {
+        long covered = ws_utf8_simd(data + i, length - i);
+        if (covered < 0) return 0;
+
+        i = ws_utf8_resume_point(data, i, i + covered);
+    }
+
+    return ws_utf8_scalar(state, data + i, length - i);
+}
+
+// Returns 1 if the message ended on a character boundary
+int ws_utf8_finish(const ws_utf8_state_t *state) {
+    return state->needed == 0;
+}
+
+int ws_validate_utf8(const uint8_t *data, size_t length) {
+    ws_utf8_state_t state;
+
+    ws_utf8_init(&state);
+    return ws_utf8_validate_chunk(&state, data, length) && ws_utf8_finish(&state);
 }
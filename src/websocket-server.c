@@ -1,167 +1,528 @@
 #include "websocket.h"
 
-static ws_event_target_t *global_event_target = NULL;
+void ws_server_config_init(ws_server_config_t *config) {
+    memset(config, 0, sizeof(*config));
+    config->port = 8080;
+    config->mode = WS_MODE_THREADED;
+    config->max_clients = MAX_CLIENTS;
+    config->workers = 1;
+    config->max_payload_size = WS_DEFAULT_MAX_PAYLOAD;
+    config->max_message_size = WS_DEFAULT_MAX_MESSAGE;
+    config->zero_copy = 1;
+    config->write_high_watermark = WS_DEFAULT_HIGH_WATERMARK;
+    config->write_low_watermark = WS_DEFAULT_LOW_WATERMARK;
+    config->slow_client_policy = WS_SLOW_CLIENT_DROP;
+    config->permessage_deflate = 0;
+    config->deflate_threshold = WS_DEFAULT_DEFLATE_THRESHOLD;
+    config->deflate_level = Z_DEFAULT_COMPRESSION;
+    config->deflate_mem_level = 8;
+    config->deflate_window_bits = 15;
+    config->inflate_window_bits = 15;
+    config->deflate_no_context_takeover = 0;
+    config->deflate_backend = WS_DEFLATE_BACKEND_AUTO;
+    config->handshake_timeout_ms = WS_DEFAULT_HANDSHAKE_TIMEOUT;
+    config->listen_backlog = SOMAXCONN;
+    config->defer_accept_seconds = 0;
+    config->ping_interval_ms = 0;
+    config->pong_timeout_ms = WS_DEFAULT_PONG_TIMEOUT;
+    config->idle_timeout_ms = 0;
+    config->close_timeout_ms = WS_DEFAULT_CLOSE_TIMEOUT;
+    config->fragment_size = 0;
+    config->rate_limit_burst_ms = WS_DEFAULT_RATE_BURST;
+}
+
+static int ws_clamp(int value, int low, int high) {
+    return value < low ? low : value > high ? high : value;
+}
 
 ws_server_t* ws_server_create(int port) {
+    ws_server_config_t config;
+    ws_server_config_init(&config);
+    config.port = port;
+    return ws_server_create_ex(&config);
+}
+
+ws_server_t* ws_server_create_ex(const ws_server_config_t *config) {
+    if (!config || config->max_clients <= 0 || config->workers <= 0) return NULL;
+
     ws_server_t *server = malloc(sizeof(ws_server_t));
     if (!server) return NULL;
 
-    server->port = port;
-    server->max_clients = MAX_CLIENTS;
-    server->clients = calloc(MAX_CLIENTS, sizeof(ws_client_t));
+    server->socket = -1;
+    server->port = config->port;
+    server->max_clients = config->max_clients;
+    server->clients.chunks = NULL;
     server->running = 0;
+    server->mode = config->mode;
+    server->workers = NULL;
+    server->worker_count = 0;
+    server->event_target = NULL;
+    server->max_payload_size = config->max_payload_size ? config->max_payload_size : WS_DEFAULT_MAX_PAYLOAD;
+    server->max_message_size = config->max_message_size ? config->max_message_size : WS_DEFAULT_MAX_MESSAGE;
+    server->zero_copy = config->zero_copy;
+    server->write_high_watermark = config->write_high_watermark ? config->write_high_watermark : WS_DEFAULT_HIGH_WATERMARK;
+    server->write_low_watermark = config->write_low_watermark;
+    server->slow_client_policy = config->slow_client_policy;
+    server->extension_count = 0;
+    server->handshake_timeout_ms = config->handshake_timeout_ms > 0 ? config->handshake_timeout_ms : 0;
+    server->listen_backlog = config->listen_backlog > 0 ? config->listen_backlog : SOMAXCONN;
+    server->defer_accept_seconds = config->defer_accept_seconds > 0 ? config->defer_accept_seconds : 0;
+    server->ping_interval_ms = config->ping_interval_ms > 0 ? config->ping_interval_ms : 0;
+    server->pong_timeout_ms = config->pong_timeout_ms > 0 ? config->pong_timeout_ms : 0;
+    server->idle_timeout_ms = config->idle_timeout_ms > 0 ? config->idle_timeout_ms : 0;
+    server->close_timeout_ms = config->close_timeout_ms > 0 ? config->close_timeout_ms : 0;
+    server->fragment_size = config->fragment_size;
+    server->cork = config->cork;
+    server->deflate_threshold = config->deflate_threshold;
+
+    // The most we will agree to; each handshake narrows it to what the client offered
+    memset(&server->deflate_limits, 0, sizeof(server->deflate_limits));
+    server->deflate_limits.server_no_context_takeover = config->deflate_no_context_takeover;
+    server->deflate_limits.client_no_context_takeover = config->deflate_no_context_takeover;
+    server->deflate_limits.server_max_window_bits = ws_clamp(config->deflate_window_bits, 9, 15);
+    server->deflate_limits.client_max_window_bits = ws_clamp(config->inflate_window_bits, 9, 15);
+    server->deflate_limits.level = ws_clamp(config->deflate_level, Z_DEFAULT_COMPRESSION, 9);
+    server->deflate_limits.mem_level = ws_clamp(config->deflate_mem_level, 1, 9);
+    server->deflate_limits.backend = config->deflate_backend;
+
+    if (config->permessage_deflate) {
+        ws_server_add_extension(server, &ws_permessage_deflate);
+    }
+
+    if (server->write_low_watermark > server->write_high_watermark) {
+        server->write_low_watermark = server->write_high_watermark;
+    }
 
     if (pthread_mutex_init(&server->clients_mutex, NULL) != 0) {
-        free(server->clients);
         free(server);
         return NULL;
     }
 
-    // Initialize client mutexes
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        pthread_mutex_init(&server->clients[i].mutex, NULL);
-        server->clients[i].buffer = malloc(BUFFER_SIZE);
-        server->clients[i].buffer_size = BUFFER_SIZE;
-        server->clients[i].connected = 0;
+    if (ws_server_limits_init(server, config) < 0) {
+        pthread_mutex_destroy(&server->clients_mutex);
+        free(server);
+        return NULL;
+    }
+
+    if (ws_server_topics_init(server, server->mode == WS_MODE_EPOLL ? config->workers : WS_TOPIC_SHARDS) < 0) {
+        ws_server_limits_destroy(server);
+        pthread_mutex_destroy(&server->clients_mutex);
+        free(server);
+        return NULL;
+    }
+
+    if (server->mode == WS_MODE_EPOLL) {
+        // Split the client table between the workers
+        int per_worker = (config->max_clients + config->workers - 1) / config->workers;
+
+        server->workers = calloc(config->workers, sizeof(ws_worker_t));
+        if (!server->workers) {
+            ws_server_destroy(server);
+            return NULL;
+        }
+
+        for (int i = 0; i < config->workers; i++) {
+            if (ws_worker_init(&server->workers[i], server, i, per_worker) < 0) {
+                ws_server_destroy(server);
+                return NULL;
+            }
+            server->worker_count++;
+        }
+
+        return server;
+    }
+
+    if (ws_client_table_init(&server->clients, server->max_clients, server, NULL) < 0) {
+        ws_server_destroy(server);
+        return NULL;
     }
 
     return server;
 }
 
-void ws_server_set_event_target(ws_server_t *server, ws_event_target_t *target) {
-    global_event_target = target;
+// Visit every connected client in whichever table layout the mode uses
+void ws_server_foreach_client(ws_server_t *server, ws_client_visitor_t visit, void *ctx) {
+    if (server->clients.chunks) {
+        ws_client_table_foreach(&server->clients, visit, ctx);
+    }
+
+    for (int w = 0; w < server->worker_count; w++) {
+        ws_client_table_foreach(&server->workers[w].clients, visit, ctx);
+    }
 }
 
-int ws_handshake(int client_socket) {
-    char buffer[4096];
-    char response[1024];
-    char *sec_websocket_key = NULL;
-    char accept_key[64];
+ws_client_id_t ws_client_id(const ws_client_t *client) {
+    return (ws_client_id_t)client->generation << 32 | client->slot;
+}
 
-    // Read HTTP request
-    int bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_read <= 0) return -1;
+// The connection an id names, or NULL once it has closed. Lock-free; the
+// connection may still close right after, so to send use ws_server_send_to.
+ws_client_t* ws_server_find_client(ws_server_t *server, ws_client_id_t id) {
+    uint32_t slot = (uint32_t)id;
+    uint32_t generation = (uint32_t)(id >> 32);
+    ws_client_table_t *table = &server->clients;
+
+    if (server->worker_count > 0) {
+        uint32_t per_worker = server->workers[0].clients.max_clients;
+        if (slot / per_worker >= (uint32_t)server->worker_count) return NULL;
+        table = &server->workers[slot / per_worker].clients;
+    }
+    if (!table->chunks) return NULL;
 
-    buffer[bytes_read] = '\0';
+    ws_client_t *client = ws_client_table_slot(table, slot - table->first_slot);
+    if (!client || __atomic_load_n(&client->generation, __ATOMIC_RELAXED) != generation || !client->connected) {
+        return NULL;
+    }
+    return client;
+}
 
-    // Parse HTTP headers
-    char *line = strtok(buffer, "\r\n");
-    while (line) {
-        if (strncmp(line, "Sec-WebSocket-Key:", 18) == 0) {
-            sec_websocket_key = line + 19;
-            while (*sec_websocket_key == ' ') sec_websocket_key++;
-            break;
-        }
-        line = strtok(NULL, "\r\n");
+void ws_server_set_event_target(ws_server_t *server, ws_event_target_t *target) {
+    server->event_target = target;
+}
+
+void ws_client_emit_connection(ws_client_t *client) {
+    ws_event_target_t *target = client->server->event_target;
+    if (target && target->on_connection) {
+        target->on_connection(client);
     }
+}
 
-    if (!sec_websocket_key) return -1;
+void ws_client_emit_close(ws_client_t *client) {
+    ws_event_target_t *target = client->server->event_target;
+    if (target && target->on_close) {
+        target->on_close(client);
+    }
+}
 
-    // Generate accept key
-    ws_generate_accept_key(sec_websocket_key, accept_key);
+void ws_client_emit_error(ws_client_t *client, const char *error) {
+    ws_event_target_t *target = client->server->event_target;
+    if (target && target->on_error) {
+        target->on_error(client, error);
+    }
+}
 
-    // Send HTTP response
-    snprintf(response, sizeof(response),
-             "HTTP/1.1 101 Switching Protocols\r\n"
-             "Upgrade: websocket\r\n"
-             "Connection: Upgrade\r\n"
-             "Sec-WebSocket-Accept: %s\r\n\r\n",
-             accept_key);
+void ws_client_emit_drain(ws_client_t *client) {
+    ws_event_target_t *target = client->server->event_target;
+    if (target && target->on_drain) {
+        target->on_drain(client);
+    }
+}
 
-    return send(client_socket, response, strlen(response), 0);
+// We sent a close frame and are still reading until the peer's arrives.
+// After a framing error there is nothing more we could parse.
+int ws_client_awaiting_close(ws_client_t *client) {
+    return client->state == WS_STATE_CLOSING && !client->close_received && !client->parser.error &&
+           client->server->close_timeout_ms > 0;
 }
 
-void* client_handler(void *arg) {
-    ws_client_t *client = (ws_client_t*)arg;
-    uint8_t buffer[BUFFER_SIZE];
-    ws_frame_t frame;
+// Run the connection's heartbeat, idle and close deadlines; shared by both
+// I/O models. Returns -1 if it must be dropped now, else 0 with *next set to
+// the nearest deadline still ahead (0 for none).
+int ws_client_expire(ws_client_t *client, uint64_t now, uint64_t *next) {
+    ws_server_t *server = client->server;
+    uint64_t deadline = 0;
 
-    // Perform handshake
-    if (ws_handshake(client->socket) < 0) {
-        close(client->socket);
-        client->connected = 0;
-        return NULL;
+    *next = 0;
+
+    if (client->state == WS_STATE_CLOSING) {
+        if (!ws_client_awaiting_close(client)) return 0;
+        if (now >= client->close_deadline) return -1;
+        *next = client->close_deadline;
+        return 0;
+    }
+    if (client->state != WS_STATE_OPEN) return 0;
+
+    if (server->idle_timeout_ms > 0 && now - client->last_message >= (uint64_t)server->idle_timeout_ms) {
+        ws_client_send_close(client, 1001, "Idle timeout");
+        if (ws_client_awaiting_close(client)) *next = client->close_deadline;
+        return 0;
+    }
+
+    // Any bytes from the peer count as the answer to a ping
+    if (client->ping_sent && server->pong_timeout_ms > 0 &&
+        now - client->ping_sent >= (uint64_t)server->pong_timeout_ms) {
+        ws_client_emit_error(client, "Pong timeout");
+        return -1;
     }
 
-    if (global_event_target && global_event_target->on_connection) {
-        global_event_target->on_connection(client);
+    if (server->ping_interval_ms > 0 && !client->ping_sent &&
+        now - client->last_received >= (uint64_t)server->ping_interval_ms) {
+        ws_client_send_frame(client, WS_PING, NULL, 0);
+        client->ping_sent = now;
     }
 
-    while (client->connected) {
-        int bytes_received = recv(client->socket, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0) {
+    if (client->ping_sent) {
+        if (server->pong_timeout_ms > 0) deadline = client->ping_sent + server->pong_timeout_ms;
+    } else if (server->ping_interval_ms > 0) {
+        deadline = client->last_received + server->ping_interval_ms;
+    }
+
+    if (server->idle_timeout_ms > 0) {
+        uint64_t idle = client->last_message + server->idle_timeout_ms;
+        if (!deadline || idle < deadline) deadline = idle;
+    }
+
+    *next = deadline;
+    return 0;
+}
+
+// Handle one parsed frame; shared by both I/O models. Control frames may
+// arrive between the fragments of a data message and are answered at once.
+void ws_client_handle_frame(ws_client_t *client, ws_frame_t *frame) {
+    // Once our close is sent only the peer's close matters (section 1.4)
+    if (client->state != WS_STATE_OPEN && frame->opcode != WS_CLOSE) return;
+
+    switch (frame->opcode) {
+        case WS_TEXT:
+        case WS_BINARY:
+        case WS_CONTINUATION:
+            client->last_message = client->last_received;
+            ws_client_message_frame(client, frame);
             break;
-        }
 
-        // Parse WebSocket frame
-        int frame_size = ws_parse_frame(buffer, bytes_received, &frame);
-        if (frame_size < 0) {
-            if (global_event_target && global_event_target->on_error) {
-                global_event_target->on_error(client, "Invalid frame");
-            }
+        case WS_PING:
+            ws_client_send_frame(client, WS_PONG, frame->payload, frame->payload_length);
             break;
-        }
 
-        // Handle different frame types
-        switch (frame.opcode) {
-            case WS_TEXT:
-                if (ws_validate_utf8(frame.payload, frame.payload_length)) {
-                    if (global_event_target && global_event_target->on_message) {
-                        global_event_target->on_message(client, (char*)frame.payload, frame.payload_length, WS_TEXT);
-                    }
-                } else {
-                    ws_send_close(client->socket, 1007, "Invalid UTF-8");
-                    client->connected = 0;
-                }
-                break;
+        case WS_PONG:
+            // Liveness is tracked per read in ws_client_process_data
+            break;
 
-            case WS_BINARY:
-                if (global_event_target && global_event_target->on_message) {
-                    global_event_target->on_message(client, (char*)frame.payload, frame.payload_length, WS_BINARY);
-                }
-                break;
+        case WS_CLOSE:
+            // Answer unless this is the reply to ours
+            client->close_received = 1;
+            ws_client_send_close(client, 1000, "Normal closure");
+            break;
+    }
+}
 
-            case WS_PING:
-                ws_send_pong(client->socket, frame.payload, frame.payload_length);
-                break;
+// Release per-connection state so the slot can be reused
+void ws_client_reset(ws_client_t *client) {
+    client->buffer_pos = 0;
+    ws_parser_reset(&client->parser);
+    client->parser.allowed_rsv = 0;
+    ws_client_message_reset(client);
+    client->ping_sent = 0;
+    client->close_deadline = 0;
+    client->close_received = 0;
+    ws_client_limits_detach(client);
+    ws_client_unsubscribe_all(client);
+
+    pthread_mutex_lock(&client->mutex);
+    ws_extensions_destroy_locked(client);
+    client->deflate.enabled = 0;
+    ws_write_queue_clear(&client->write_queue);
+    client->write_blocked = 0;
+    pthread_cond_broadcast(&client->writable); // Release producers blocked on this client
+    pthread_mutex_unlock(&client->mutex);
+}
 
-            case WS_PONG:
-                // Handle pong frame
-                break;
+static int ws_client_on_frame(void *ctx, ws_frame_t *frame) {
+    ws_client_t *client = (ws_client_t*)ctx;
 
-            case WS_CLOSE:
-                ws_send_close(client->socket, 1000, "Normal closure");
-                client->connected = 0;
-                break;
-        }
+    ws_client_handle_frame(client, frame);
+    if (client->state != WS_STATE_OPEN) return !ws_client_awaiting_close(client);
+
+    // Over a receive limit: the rest of the read waits until the debt is paid
+    return frame->opcode != WS_CONTINUATION && ws_client_limits_charge(client, 1, 0);
+}
+
+// Run received bytes through the connection's frame parser.
+// Returns 0 on success, -1 after a protocol error (a close frame has been
+// queued), or the number of bytes a receive limit left unparsed. Those are
+// moved to the start of data and must be fed again before anything newer.
+int ws_client_process_data(ws_client_t *client, uint8_t *data, size_t length) {
+    client->last_received = ws_monotonic_ms();
+    client->ping_sent = 0;
+
+    int result = ws_parser_feed(&client->parser, data, length, ws_client_on_frame, client);
+    size_t kept = result == 1 && client->state == WS_STATE_OPEN ? length - client->parser.consumed : 0;
 
-        free(frame.payload);
+    // Bytes are paid for after parsing; a read that overdrew makes the next one wait
+    ws_client_limits_charge(client, 0, length - kept);
+
+    if (kept > 0) {
+        memmove(data, data + length - kept, kept);
+        return (int)kept;
+    }
+    if (result >= 0) return 0;
+
+    uint16_t code = client->parser.error;
+    ws_client_emit_error(client, "Invalid frame");
+    ws_client_send_close(client, code, code == 1009 ? "Message too big" : "Protocol error");
+    return -1;
+}
+
+// Threaded model: how often a connection thread must wake to run its
+// deadlines, in milliseconds (0 if it never needs to)
+static int ws_client_timer_period(ws_server_t *server) {
+    int periods[4] = { server->ping_interval_ms, server->ping_interval_ms ? server->pong_timeout_ms : 0,
+                       server->idle_timeout_ms, server->close_timeout_ms };
+    int period = 0;
+
+    for (int i = 0; i < 4; i++) {
+        if (periods[i] > 0 && (period == 0 || periods[i] < period)) period = periods[i];
+    }
+    return period;
+}
+
+// Threaded model: connection threads release their own slots, so take the
+// acceptor's lock
+static void ws_server_release_client(ws_client_t *client) {
+    ws_server_t *server = client->server;
+
+    pthread_mutex_lock(&server->clients_mutex);
+    ws_client_table_release(&server->clients, client);
+    pthread_mutex_unlock(&server->clients_mutex);
+}
+
+// Threaded model: replies the callbacks send while a chunk is handled go
+// out together afterwards when corking
+static int ws_client_handle_data(ws_client_t *client, uint8_t *data, size_t length) {
+    ws_client_cork(client);
+    int result = ws_client_process_data(client, data, length);
+    ws_client_uncork(client);
+    return result;
+}
+
+// Threaded model: wait up to timeout ms for input (when asked), for room to
+// write queued output, or for another thread to queue some, and write out
+// what fits. Returns 1 when there is input to read, 0 when not, -1 if the
+// connection failed.
+static int ws_client_poll(ws_client_t *client, int input, int timeout) {
+    struct pollfd fds[2];
+
+    fds[0].fd = client->socket;
+    fds[0].events = (input ? POLLIN : 0) | (ws_client_output_pending(client) ? POLLOUT : 0);
+    fds[1].fd = client->wake_fd;
+    fds[1].events = POLLIN;
+
+    if (poll(fds, 2, timeout) < 0) {
+        return errno == EINTR ? 0 : -1;
     }
 
-    if (global_event_target && global_event_target->on_close) {
-        global_event_target->on_close(client);
+    if (fds[1].revents & POLLIN) {
+        uint64_t value;
+        while (read(client->wake_fd, &value, sizeof(value)) > 0);
     }
 
+    // Hung up: recv reports it, or when we are not reading, we do
+    if (fds[0].revents & (POLLERR | POLLHUP)) {
+        return input ? 1 : -1;
+    }
+
+    if ((fds[0].revents & POLLOUT || fds[1].revents & POLLIN) && ws_client_flush(client) < 0) {
+        return -1;
+    }
+    return input && fds[0].revents & POLLIN ? 1 : 0;
+}
+
+void* client_handler(void *arg) {
+    ws_client_t *client = (ws_client_t*)arg;
+    uint8_t buffer[BUFFER_SIZE];
+
+    // Perform handshake; from then on this thread writes out what other
+    // threads queue for the connection
+    int pipelined = ws_handshake_read(client, (char*)buffer, sizeof(buffer));
+    if (pipelined < 0 || ws_client_attach_thread(client) < 0) {
+        close(client->socket);
+        client->state = WS_STATE_CLOSED;
+        ws_client_reset(client);
+        ws_server_release_client(client);
+        return NULL;
+    }
+
+    client->state = WS_STATE_OPEN;
+    client->last_received = client->last_message = ws_monotonic_ms();
+    ws_client_limits_attach(client);
+
+    // Deadlines are checked whenever poll returns, and poll gives up after a
+    // period, so they run late by at most that much. A close started by
+    // another thread is noticed the same way.
+    int period = ws_client_timer_period(client->server);
+
+    ws_client_emit_connection(client);
+
+    // Frames the client sent right behind the upgrade request; a protocol
+    // error queues a close, which ends the loop below. Bytes a receive limit
+    // held back stay at the front of the buffer.
+    int pending = pipelined > 0 ? ws_client_handle_data(client, buffer, pipelined) : 0;
+    if (pending < 0) pending = 0;
+
+    // After our close, stay until the peer's arrives or our output is out
+    while (client->connected && (client->state == WS_STATE_OPEN || ws_client_awaiting_close(client) ||
+                                 (client->state == WS_STATE_CLOSING && ws_client_buffered_amount(client) > 0))) {
+        // Over a receive limit: leave its data in the socket until the debt is paid
+        int wait = ws_client_limits_wait(client);
+        if (wait <= 0 && pending > 0) {
+            pending = ws_client_handle_data(client, buffer, pending);
+            if (pending < 0) break;
+        } else {
+            // Wake for deadlines every period, and once a receive limit's wait is over
+            int timeout = period > 0 ? period : -1;
+            if (wait > 0 && (timeout < 0 || wait < timeout)) timeout = wait;
+
+            int readable = ws_client_poll(client, wait <= 0, timeout);
+            if (readable < 0) break;
+
+            if (readable) {
+                ssize_t bytes_received = recv(client->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (bytes_received == 0 ||
+                    (bytes_received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    break;
+                }
+
+                // Parse every WebSocket frame in the chunk
+                if (bytes_received > 0) {
+                    pending = ws_client_handle_data(client, buffer, bytes_received);
+                    if (pending < 0) break;
+                }
+            }
+        }
+
+        uint64_t next;
+        if (period > 0 && ws_client_expire(client, ws_monotonic_ms(), &next) < 0) {
+            break;
+        }
+    }
+
+    ws_client_emit_close(client);
+
+    client->state = WS_STATE_CLOSED;
+    ws_client_detach_thread(client);
     close(client->socket);
-    client->connected = 0;
+    ws_client_reset(client);
+    ws_server_release_client(client);
     return NULL;
 }
 
-void* server_thread(void *arg) {
-    ws_server_t *server = (ws_server_t*)arg;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+// Create a non-blocking socket listening on the server's port; returns the
+// descriptor or -1
+int ws_server_listen(ws_server_t *server, int reuseport) {
+    struct sockaddr_in server_addr;
 
     // Create socket
-    server->socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server->socket < 0) {
+    int listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_socket < 0) {
         perror("socket");
-        return NULL;
+        return -1;
     }
 
     // Set socket options
     int opt = 1;
-    setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        close(listen_socket);
+        return -1;
+    }
+
+    // Don't wake the acceptor until the client has sent its upgrade request
+    if (server->defer_accept_seconds > 0 &&
+        setsockopt(listen_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &server->defer_accept_seconds,
+                   sizeof(server->defer_accept_seconds)) < 0) {
+        perror("setsockopt(TCP_DEFER_ACCEPT)");
+    }
 
     // Bind socket
     memset(&server_addr, 0, sizeof(server_addr));
@@ -169,60 +530,91 @@ void* server_thread(void *arg) {
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(server->port);
 
-    if (bind(server->socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(listen_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("bind");
-        close(server->socket);
-        return NULL;
+        close(listen_socket);
+        return -1;
     }
 
     // Listen for connections
-    if (listen(server->socket, 5) < 0) {
+    if (listen(listen_socket, server->listen_backlog) < 0) {
         perror("listen");
-        close(server->socket);
+        close(listen_socket);
+        return -1;
+    }
+
+    return listen_socket;
+}
+
+// Give an accepted connection a slot and a thread; the handshake runs on
+// that thread so the acceptor never waits for the client
+static void ws_server_admit(ws_server_t *server, int client_socket, const struct sockaddr_in *client_addr) {
+    // Find free client slot
+    pthread_mutex_lock(&server->clients_mutex);
+    ws_client_t *client = ws_client_table_acquire(&server->clients);
+    if (!client) {
+        // No free slots
+        close(client_socket);
+        pthread_mutex_unlock(&server->clients_mutex);
+        return;
+    }
+
+    // Initialize client
+    client->socket = client_socket;
+    client->buffer_pos = 0;
+    client->address = *client_addr;
+    client->state = WS_STATE_HANDSHAKE;
+
+    pthread_mutex_unlock(&server->clients_mutex);
+
+    // Create thread for client
+    pthread_t client_thread;
+    if (pthread_create(&client_thread, NULL, client_handler, client) != 0) {
+        close(client_socket);
+        client->state = WS_STATE_CLOSED;
+        ws_server_release_client(client);
+        return;
+    }
+    pthread_detach(client_thread);
+}
+
+void* server_thread(void *arg) {
+    ws_server_t *server = (ws_server_t*)arg;
+
+    server->socket = ws_server_listen(server, 0);
+    if (server->socket < 0) {
         return NULL;
     }
 
     printf("WebSocket server listening on port %d\n", server->port);
 
     while (server->running) {
-        int client_socket = accept(server->socket, (struct sockaddr*)&client_addr, &client_len);
-        if (client_socket < 0) {
-            if (server->running) {
-                perror("accept");
-            }
-            continue;
+        struct pollfd pfd;
+        pfd.fd = server->socket;
+        pfd.events = POLLIN;
+
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
         }
 
-        // Find free client slot
-        pthread_mutex_lock(&server->clients_mutex);
-        int client_index = -1;
-        for (int i = 0; i < server->max_clients; i++) {
-            if (!server->clients[i].connected) {
-                client_index = i;
+        // Drain the backlog in batches; accepted sockets stay blocking for
+        // their connection threads
+        for (int i = 0; i < WS_ACCEPT_BATCH && server->running; i++) {
+            struct sockaddr_in client_addr;
+            socklen_t client_len = sizeof(client_addr);
+
+            int client_socket = accept4(server->socket, (struct sockaddr*)&client_addr, &client_len, SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK && server->running) {
+                    perror("accept4");
+                }
                 break;
             }
-        }
 
-        if (client_index == -1) {
-            // No free slots
-            close(client_socket);
-            pthread_mutex_unlock(&server->clients_mutex);
-            continue;
+            ws_server_admit(server, client_socket, &client_addr);
         }
-
-        // Initialize client
-        ws_client_t *client = &server->clients[client_index];
-        client->socket = client_socket;
-        client->connected = 1;
-        client->buffer_pos = 0;
-        client->address = client_addr;
-
-        pthread_mutex_unlock(&server->clients_mutex);
-
-        // Create thread for client
-        pthread_t client_thread;
-        pthread_create(&client_thread, NULL, client_handler, client);
-        pthread_detach(client_thread);
     }
 
     close(server->socket);
@@ -231,12 +623,36 @@ void* server_thread(void *arg) {
 
 int ws_server_start(ws_server_t *server) {
     server->running = 1;
+
+    if (server->mode == WS_MODE_EPOLL) {
+        // Each worker binds its own SO_REUSEPORT listener; the kernel spreads connections
+        for (int i = 0; i < server->worker_count; i++) {
+            if (ws_worker_start(&server->workers[i]) != 0) {
+                ws_server_stop(server);
+                return -1;
+            }
+        }
+
+        printf("WebSocket server listening on port %d (%d workers)\n", server->port, server->worker_count);
+        return 0;
+    }
+
     return pthread_create(&server->server_thread, NULL, server_thread, server);
 }
 
 void ws_server_stop(ws_server_t *server) {
+    if (!server->running) return;
+
     server->running = 0;
-    close(server->socket);
+
+    if (server->mode == WS_MODE_EPOLL) {
+        for (int i = 0; i < server->worker_count; i++) {
+            ws_worker_stop(&server->workers[i]);
+        }
+        return;
+    }
+
+    shutdown(server->socket, SHUT_RDWR);
     pthread_join(server->server_thread, NULL);
 }
 
@@ -244,16 +660,15 @@ void ws_server_destroy(ws_server_t *server) {
     if (server) {
         ws_server_stop(server);
 
-        // Close all client connections
-        for (int i = 0; i < server->max_clients; i++) {
-            if (server->clients[i].connected) {
-                close(server->clients[i].socket);
-            }
-            free(server->clients[i].buffer);
-            pthread_mutex_destroy(&server->clients[i].mutex);
+        ws_client_table_destroy(&server->clients);
+
+        for (int i = 0; i < server->worker_count; i++) {
+            ws_worker_destroy(&server->workers[i]);
         }
 
-        free(server->clients);
+        free(server->workers);
+        ws_server_limits_destroy(server);
+        ws_server_topics_destroy(server);
         pthread_mutex_destroy(&server->clients_mutex);
         free(server);
     }
@@ -6,18 +6,20 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
-#include <openssl/sha.h>
-#include <openssl/evp.h>
-#include <openssl/bio.h>
-#include <openssl/buffer.h>
 #include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <time.h>
+#include <poll.h>
 #include <zlib.h>
 
 // Constants
@@ -26,6 +28,27 @@
 #define MAX_FRAME_SIZE 65536
 #define MAX_CLIENTS 100
 #define BUFFER_SIZE 8192
+#define WS_MAX_EVENTS 256
+#define WS_ACCEPT_BATCH 64          // Connections accepted per listener wakeup
+#define WS_HANDSHAKE_SIZE 4096
+#define WS_MAX_HEADER_SIZE 14
+#define WS_DEFAULT_MAX_PAYLOAD (16 * 1024 * 1024)
+#define WS_DEFAULT_MAX_MESSAGE (16 * 1024 * 1024)
+#define WS_INFLATE_CHUNK 16384
+#define WS_PARSER_SPILL_KEEP 65536
+#define WS_WRITE_IOV_MAX 64
+#define WS_CORK_BYTES (64 * 1024)   // Corked output this large is written at once
+#define WS_DEFAULT_HIGH_WATERMARK (1024 * 1024)
+#define WS_DEFAULT_LOW_WATERMARK (256 * 1024)
+#define WS_DEFAULT_DEFLATE_THRESHOLD 1024
+#define WS_DEFAULT_HANDSHAKE_TIMEOUT 10000  // Milliseconds from accept to a complete upgrade request
+#define WS_DEFAULT_PONG_TIMEOUT 10000       // Milliseconds to wait for an answer to an automatic ping
+#define WS_DEFAULT_CLOSE_TIMEOUT 5000       // Milliseconds to wait for the peer's close frame
+#define WS_DEFAULT_RATE_BURST 1000          // Milliseconds of traffic a rate limit lets through at once
+#define WS_HTTP_MAX_OFFERS 8
+
+// First header byte bits
+#define WS_RSV1 0x40                // permessage-deflate: message is compressed
 
 // WebSocket opcodes
 typedef enum {
@@ -50,89 +73,681 @@ typedef struct {
     uint8_t *payload;
 } ws_frame_t;
 
-// WebSocket client structure
+// Incremental frame parser state (one per connection)
+typedef enum {
+    WS_PARSE_HEADER = 0,
+    WS_PARSE_PAYLOAD
+} ws_parser_state_t;
+
+typedef struct {
+    ws_parser_state_t state;
+    uint8_t header[WS_MAX_HEADER_SIZE];
+    size_t header_len;
+    ws_frame_t frame;
+    uint64_t payload_pos;
+    uint64_t max_payload;
+    int require_mask;
+    uint8_t allowed_rsv;        // RSV bits claimed by negotiated extensions
+    int zero_copy;              // Hand out views into the caller's chunk when possible
+    int payload_owned;          // frame.payload was pool-allocated for this frame
+    uint8_t *spill;             // Reused storage for frames that span reads (zero-copy mode)
+    size_t spill_capacity;
+    uint16_t error;             // Close code describing the last failure
+    size_t consumed;            // Bytes of the chunk used when on_frame asked to stop
+} ws_parser_t;
+
+// Called for every complete frame; return non-zero to stop parsing
+typedef int (*ws_frame_handler_t)(void *ctx, ws_frame_t *frame);
+
+// Buffer utilities
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} ws_buffer_t;
+
+ws_buffer_t* ws_buffer_create(size_t initial_capacity);
+void ws_buffer_destroy(ws_buffer_t *buffer);
+int ws_buffer_append(ws_buffer_t *buffer, const uint8_t *data, size_t length);
+void ws_buffer_clear(ws_buffer_t *buffer);
+
+// Immutable, reference-counted bytes (usually an encoded frame) that can be
+// queued to many connections without copying
+typedef struct {
+    int refcount;
+    size_t length;
+    uint8_t data[];
+} ws_shared_buffer_t;
+
+// Per-connection outbound queue of shared buffers
+typedef struct ws_write_chunk {
+    ws_shared_buffer_t *buffer;
+    size_t offset;              // Bytes of buffer already written
+    struct ws_write_chunk *next;
+} ws_write_chunk_t;
+
+// Every chunk holds one whole frame, so chunk boundaries are frame
+// boundaries and pings/pongs can be slotted in between
+typedef struct {
+    ws_write_chunk_t *head;
+    ws_write_chunk_t *tail;
+    ws_write_chunk_t *urgent;   // Last chunk pushed ahead of the others, NULL once it is written
+    size_t bytes;               // Pending bytes
+    size_t count;               // Pending chunks
+} ws_write_queue_t;
+
+ws_shared_buffer_t* ws_shared_buffer_create(size_t length);
+ws_shared_buffer_t* ws_shared_buffer_ref(ws_shared_buffer_t *buffer);
+void ws_shared_buffer_release(ws_shared_buffer_t *buffer);
+void ws_write_queue_init(ws_write_queue_t *queue);
+int ws_write_queue_push(ws_write_queue_t *queue, ws_shared_buffer_t *buffer, size_t offset);
+int ws_write_queue_push_urgent(ws_write_queue_t *queue, ws_shared_buffer_t *buffer, size_t offset);
+int ws_write_queue_flush(ws_write_queue_t *queue, int socket);
+int ws_write_queue_flush_urgent(ws_write_queue_t *queue, int socket);
+void ws_write_queue_clear(ws_write_queue_t *queue);
+
+// Server I/O models
+typedef enum {
+    WS_MODE_THREADED = 0,   // One detached thread per connection
+    WS_MODE_EPOLL           // Edge-triggered epoll reactor, non-blocking sockets
+} ws_server_mode_t;
+
+// What to do when a client's write queue passes the high watermark
+typedef enum {
+    WS_SLOW_CLIENT_DROP = 0,        // Discard the new message
+    WS_SLOW_CLIENT_DISCONNECT,      // Drop the connection
+    WS_SLOW_CLIENT_BLOCK            // Block the producer until the queue drains
+} ws_slow_client_policy_t;
+
+// Connection states (driven by the event loop in WS_MODE_EPOLL)
+typedef enum {
+    WS_STATE_HANDSHAKE = 0,
+    WS_STATE_OPEN,
+    WS_STATE_CLOSING,
+    WS_STATE_CLOSED
+} ws_client_state_t;
+
+// Negotiated permessage-deflate parameters (RFC 7692). The server keeps a
+// template whose flags and window sizes are the most it will agree to.
+typedef struct {
+    int enabled;
+    int server_no_context_takeover;
+    int client_no_context_takeover;
+    int server_max_window_bits;         // Window we compress with
+    int server_max_window_bits_set;     // Echo server_max_window_bits in the response
+    int client_max_window_bits;         // Window the client may compress with
+    int level;                          // Local compressor settings, not negotiated
+    int mem_level;
+    int backend;                        // ws_deflate_backend_t
+} ws_deflate_params_t;
+
+// Compressor implementation for permessage-deflate output
+typedef enum {
+    WS_DEFLATE_BACKEND_AUTO = 0,    // libdeflate when built in and usable, zlib otherwise
+    WS_DEFLATE_BACKEND_ZLIB,
+    WS_DEFLATE_BACKEND_LIBDEFLATE   // Falls back to zlib when not built in
+} ws_deflate_backend_t;
+
+// Where a header value sits in the request buffer
+typedef struct {
+    uint16_t offset;
+    uint16_t length;
+} ws_http_span_t;
+
+// Incremental upgrade request parser. It keeps no copy of the request: the
+// caller accumulates the bytes and feeds the whole buffer after every read,
+// and only the new part is scanned.
+typedef struct {
+    uint16_t scanned;           // Bytes examined so far
+    uint16_t line_start;
+    uint16_t request_length;    // Including the blank line, once complete
+    uint16_t status;            // HTTP status to reject with, 0 while valid
+    uint8_t state;
+    uint8_t seen;               // Required headers validated so far
+    uint8_t offer_count;
+    ws_http_span_t key;
+    ws_http_span_t offers[WS_HTTP_MAX_OFFERS]; // Sec-WebSocket-Extensions values
+} ws_http_parser_t;
+
+// Incremental UTF-8 validation state (carried across fragments)
+typedef struct {
+    uint8_t needed;             // Continuation bytes still expected
+    uint8_t lower;              // Allowed range for the next continuation byte
+    uint8_t upper;
+} ws_utf8_state_t;
+
+// Timing wheel (see timer.c)
+#define WS_TIMER_TICK_MS 10
+#define WS_TIMER_LEVELS 4
+#define WS_TIMER_SLOTS 64
+
+typedef struct ws_timer {
+    struct ws_timer *next;
+    struct ws_timer **pprev;    // NULL when not armed
+    uint64_t expires;           // Wheel tick
+    int slot;                   // level * WS_TIMER_SLOTS + slot
+    void (*callback)(void *ctx);
+    void *ctx;
+} ws_timer_t;
+
+typedef struct {
+    ws_timer_t *slots[WS_TIMER_LEVELS][WS_TIMER_SLOTS];
+    uint64_t occupied[WS_TIMER_LEVELS];     // Bit per non-empty slot
+    uint64_t current;                       // Last tick run
+    size_t count;
+} ws_timer_wheel_t;
+
+void ws_timer_wheel_init(ws_timer_wheel_t *wheel, uint64_t now_ms);
+void ws_timer_wheel_advance(ws_timer_wheel_t *wheel, uint64_t now_ms);
+int ws_timer_wheel_timeout(const ws_timer_wheel_t *wheel, uint64_t now_ms);
+void ws_timer_init(ws_timer_t *timer, void (*callback)(void *ctx), void *ctx);
+void ws_timer_arm(ws_timer_wheel_t *wheel, ws_timer_t *timer, uint64_t deadline_ms);
+void ws_timer_cancel(ws_timer_wheel_t *wheel, ws_timer_t *timer);
+int ws_timer_pending(const ws_timer_t *timer);
+
+// Token bucket in its GCRA form: the only state is when the bucket will be
+// full again, updated by compare-and-swap, so any thread may draw on it
+typedef struct {
+    uint64_t amount;            // Tokens added per period; 0 for no limit
+    uint64_t period_ns;
+    uint64_t burst_ns;          // Time to fill an empty bucket (its capacity)
+    uint64_t full_at;           // Monotonic nanoseconds; a later value is debt (atomic)
+} ws_token_bucket_t;
+
+void ws_token_bucket_init(ws_token_bucket_t *bucket, uint64_t amount, uint64_t period_ns, uint64_t capacity);
+int ws_token_bucket_take(ws_token_bucket_t *bucket, uint64_t tokens, uint64_t now_ns);
+void ws_token_bucket_charge(ws_token_bucket_t *bucket, uint64_t tokens, uint64_t now_ns);
+uint64_t ws_token_bucket_wait(const ws_token_bucket_t *bucket, uint64_t now_ns);
+
+// Receive budget of one tier: a connection, a source address or the server
+typedef struct {
+    ws_token_bucket_t messages;     // Data messages and control frames
+    ws_token_bucket_t bytes;
+} ws_rate_limit_t;
+
+// Budget shared by every connection from one IPv4 address
+typedef struct ws_address_limit {
+    struct ws_address_limit *next;
+    in_addr_t address;
+    int connections;
+    ws_rate_limit_t limit;
+} ws_address_limit_t;
+
+#define WS_ADDRESS_SHARDS 64
+#define WS_ADDRESS_CHAINS 1024      // Hash chains per shard
+
+typedef struct {
+    pthread_mutex_t mutex;
+    ws_address_limit_t *chains[WS_ADDRESS_CHAINS];
+} ws_address_shard_t;
+
+// Address budgets, found at connect time under one shard's lock and used
+// lock-free afterwards
 typedef struct {
+    ws_address_shard_t shards[WS_ADDRESS_SHARDS];
+    ws_rate_limit_t initial;        // Copied into each new entry
+} ws_address_table_t;
+
+struct ws_server;
+struct ws_worker;
+struct ws_extension;
+
+// Extensions negotiated per connection (RFC 6455 section 9)
+#define WS_MAX_EXTENSIONS 4
+
+typedef struct {
+    const struct ws_extension *extension;
+    void *context;              // Returned by the extension's negotiate callback
+} ws_extension_slot_t;
+
+struct ws_topic;
+
+// One of a connection's topics and its position in that topic's members
+typedef struct {
+    struct ws_topic *topic;
+    uint32_t member;
+} ws_subscription_t;
+
+// WebSocket client structure
+typedef struct ws_client {
     int socket;
     int connected;
+    uint32_t slot;              // Server-wide slot number, the low half of the id
+    uint32_t generation;        // Bumped when the slot is released, under mutex; never 0
+    int next_free;              // Table free list link while unused
     char *buffer;
     size_t buffer_size;
     size_t buffer_pos;
     pthread_mutex_t mutex;
     struct sockaddr_in address;
+    struct ws_server *server;
+    struct ws_worker *worker;
+    ws_client_state_t state;
+    ws_write_queue_t write_queue;
+    pthread_cond_t writable;    // Signalled when the queue drains to the low watermark
+    int write_blocked;          // Queue passed the high watermark; cleared on drain
+    int fragmenting;            // Threaded model: its own thread is writing a message around the queue
+    int controls_waiting;       // Control frames waiting for the fragment writer to pause (atomic)
+    ws_parser_t parser;
+    ws_deflate_params_t deflate;        // Negotiated parameters; enabled is 0 without the extension
+    ws_extension_slot_t extensions[WS_MAX_EXTENSIONS]; // In negotiation order, guarded by mutex
+    int extension_count;
+    ws_opcode_t message_opcode;         // Data message being received, WS_CONTINUATION when none
+    uint8_t message_rsv;                // Extension bits from its first frame
+    uint64_t message_length;            // Payload bytes received for it so far
+    ws_buffer_t *message;               // Reassembly buffer, kept between messages while small
+    ws_utf8_state_t message_utf8;
+    ws_http_parser_t handshake;
+    uint64_t handshake_deadline;        // Monotonic milliseconds; 0 for no deadline
+    ws_timer_t timer;                   // On the owning worker's wheel, at the nearest deadline
+    uint64_t last_received;             // When bytes last arrived
+    uint64_t last_message;              // When a data frame last arrived
+    uint64_t ping_sent;                 // When the unanswered automatic ping went out, 0 if none
+    uint64_t close_deadline;            // Drop the connection if the peer's close hasn't come; 0 waits
+    int close_received;                 // The peer's close frame arrived
+    ws_rate_limit_t limit;              // This connection's receive budget
+    ws_address_limit_t *address_limit;  // Its source address's, NULL when unlimited
+    uint64_t throttled_until;           // Epoll model: not read from until then (ms), 0 if not
+    ws_subscription_t *subscriptions;   // Guarded by its topic shard's mutex
+    uint32_t subscription_count;
+    uint32_t subscription_capacity;
+    int corked;                         // On its worker's corked list (atomic)
+    struct ws_client *next_corked;
+    int wake_fd;                        // Threaded model: eventfd telling its thread output was queued, -1 if none
+    int wake_pending;                   // wake_fd was written and the thread has not looked yet
 } ws_client_t;
 
-// WebSocket server structure
+// Receives data piece by piece; return -1 to abort
+typedef int (*ws_data_sink_t)(void *ctx, const uint8_t *data, size_t length);
+
+// A frame-transforming extension. encode and decode return 1 with a pool
+// buffer in *output, 0 to pass the payload through unchanged, -1 on error
+// (decode also sets *error to a close code). Frames an extension transformed
+// carry its rsv bits.
+typedef struct ws_extension {
+    const char *name;           // Token matched against Sec-WebSocket-Extensions offers
+    uint8_t rsv;                // RSV bits claimed, e.g. WS_RSV1
+    // Return 1 to accept the offer and write the response parameters
+    int (*negotiate)(ws_client_t *client, const char *offer, char *response, size_t response_size,
+                     void **context);
+    int (*encode)(void *context, ws_opcode_t opcode, const uint8_t *input, size_t input_len,
+                  uint8_t **output, size_t *output_len);
+    int (*decode)(void *context, const uint8_t *input, size_t input_len, size_t max_output,
+                  uint8_t **output, size_t *output_len, uint16_t *error);
+    // Optional: decode a message frame by frame, passing output to sink.
+    // final marks the last frame. Returns 0, or -1 with *error set.
+    int (*decode_stream)(void *context, const uint8_t *input, size_t input_len, int final, size_t max_output,
+                         ws_data_sink_t sink, void *sink_ctx, uint16_t *error);
+    void (*destroy)(void *context);
+} ws_extension_t;
+
+// Client slots are allocated in chunks of this many as connections arrive
+#define WS_CLIENT_CHUNK 256
+
+// Lazily grown client table; slot pointers stay valid for the table's lifetime
 typedef struct {
-    int socket;
-    int port;
+    ws_client_t **chunks;       // Directory sized for max_clients, filled on demand
+    int chunk_count;
+    int max_chunks;
     int max_clients;
-    ws_client_t *clients;
-    pthread_mutex_t clients_mutex;
-    int running;
-    pthread_t server_thread;
-} ws_server_t;
+    int free_head;              // Index of the first unused slot, -1 when all are busy
+    uint32_t first_slot;        // Server-wide number of index 0
+    struct ws_server *server;
+    struct ws_worker *worker;
+} ws_client_table_t;
+
+// Names one connection for its lifetime: generation << 32 | slot. A stale
+// id (its connection closed, the slot reused) no longer matches. 0 is never
+// a valid id.
+typedef uint64_t ws_client_id_t;
+
+// Topic shards in the threaded model; the epoll model has one per worker
+#define WS_TOPIC_SHARDS 16
+
+// Topics subscribed to by the connections of one shard, by name
+typedef struct {
+    pthread_mutex_t mutex;
+    struct ws_topic **buckets;
+    size_t bucket_count;        // Power of two
+    size_t topic_count;
+} ws_topic_shard_t;
 
 // Event target structure
 typedef struct ws_event_target {
     void (*on_connection)(ws_client_t *client);
     void (*on_message)(ws_client_t *client, const char *message, size_t length, ws_opcode_t opcode);
+    // When set, replaces on_message: data arrives as it is received, final
+    // marks the end of the message, and nothing is buffered
+    void (*on_message_chunk)(ws_client_t *client, const char *data, size_t length, ws_opcode_t opcode, int final);
     void (*on_close)(ws_client_t *client);
     void (*on_error)(ws_client_t *client, const char *error);
+    void (*on_drain)(ws_client_t *client);
 } ws_event_target_t;
 
+// Registry of named events with any number of listeners each. Dispatch is
+// lock-free; listeners are added at setup time.
+typedef struct ws_event_target_impl ws_event_target_impl_t;
+
+ws_event_target_impl_t* ws_event_target_create(void);
+void ws_event_target_destroy(ws_event_target_impl_t *target);
+int ws_event_target_intern(ws_event_target_impl_t *target, const char *event_type);
+int ws_event_target_add_listener(ws_event_target_impl_t *target, const char *event_type,
+                                 void (*callback)(ws_client_t*, void*), void *user_data);
+int ws_event_target_add_listener_id(ws_event_target_impl_t *target, int type,
+                                    void (*callback)(ws_client_t*, void*), void *user_data);
+void ws_event_target_dispatch(ws_event_target_impl_t *target, const char *event_type,
+                              ws_client_t *client, void *data);
+void ws_event_target_dispatch_id(ws_event_target_impl_t *target, int type, ws_client_t *client, void *data);
+
+// Server configuration (see ws_server_create_ex)
+typedef struct {
+    int port;
+    ws_server_mode_t mode;
+    int max_clients;
+    int workers;            // Event loops in WS_MODE_EPOLL, one SO_REUSEPORT listener each
+    uint64_t max_payload_size;
+    uint64_t max_message_size;  // Limit on a decompressed message
+    int zero_copy;          // Deliver payloads as views into the receive buffer
+    size_t write_high_watermark;
+    size_t write_low_watermark;
+    ws_slow_client_policy_t slow_client_policy;
+    int permessage_deflate;     // Accept permessage-deflate offers
+    size_t deflate_threshold;   // Send smaller messages uncompressed
+    int deflate_level;          // zlib level, Z_DEFAULT_COMPRESSION or 0..9
+    int deflate_mem_level;      // zlib memLevel 1..9 (hash table size)
+    int deflate_window_bits;    // Largest window we compress with, 9..15
+    int inflate_window_bits;    // Window we ask clients to compress with when they allow it
+    int deflate_no_context_takeover; // Demand no_context_takeover both ways so contexts are pooled
+    ws_deflate_backend_t deflate_backend;
+    int handshake_timeout_ms;   // Drop connections that don't upgrade in time; 0 waits forever
+    int listen_backlog;         // Pending connection queue; the kernel caps it at somaxconn
+    int defer_accept_seconds;   // TCP_DEFER_ACCEPT: wake on the first request bytes; 0 disables
+    int ping_interval_ms;       // Ping connections that have been silent this long; 0 disables
+    int pong_timeout_ms;        // Drop them if nothing arrives this long after the ping; 0 waits
+    int idle_timeout_ms;        // Close connections that received no data message for this long; 0 disables
+    int close_timeout_ms;       // Wait this long for the peer's close after ours; 0 closes once ours is sent
+    size_t fragment_size;       // Send larger data messages as frames of this payload size; 0 never splits
+    // Receive limits per second, 0 for none. A connection over any of them is
+    // not read from until it is back within budget, so TCP pushes back.
+    int connection_messages_per_sec;
+    int connection_bytes_per_sec;
+    int address_messages_per_sec;   // Shared by all connections from one IPv4 address
+    int address_bytes_per_sec;
+    int server_messages_per_sec;    // Shared by all connections
+    int server_bytes_per_sec;
+    int rate_limit_burst_ms;        // Bucket capacity, as time at the limit rate
+    int cork;                       // Batch small frames sent in one loop pass into one write per connection
+} ws_server_config_t;
+
+// Event loop worker: owns its listener, epoll set and client table
+typedef struct ws_worker {
+    int index;
+    int socket;
+    int epoll_fd;
+    int wake_fd;
+    pthread_t thread;
+    ws_client_table_t clients;
+    ws_timer_wheel_t timers;        // Handshake, heartbeat, idle and close deadlines
+    ws_client_t *corked;            // Connections to flush when the pass ends (atomic)
+    struct ws_server *server;
+} ws_worker_t;
+
+// WebSocket server structure
+typedef struct ws_server {
+    int socket;
+    int port;
+    int max_clients;
+    ws_client_table_t clients;  // WS_MODE_THREADED only; workers own theirs
+    pthread_mutex_t clients_mutex;
+    int running;
+    pthread_t server_thread;
+    ws_server_mode_t mode;
+    ws_worker_t *workers;
+    int worker_count;
+    ws_event_target_t *event_target;
+    uint64_t max_payload_size;
+    uint64_t max_message_size;
+    int zero_copy;
+    size_t write_high_watermark;
+    size_t write_low_watermark;
+    ws_slow_client_policy_t slow_client_policy;
+    const ws_extension_t *extensions[WS_MAX_EXTENSIONS];
+    int extension_count;
+    size_t deflate_threshold;
+    ws_deflate_params_t deflate_limits;
+    int handshake_timeout_ms;
+    int listen_backlog;
+    int defer_accept_seconds;
+    int ping_interval_ms;
+    int pong_timeout_ms;
+    int idle_timeout_ms;
+    int close_timeout_ms;
+    size_t fragment_size;
+    int rate_limited;                   // Any receive limit is set
+    ws_rate_limit_t connection_limit;   // Copied into each connection
+    ws_address_table_t *address_limits; // NULL without address limits
+    ws_rate_limit_t server_limit;
+    ws_topic_shard_t *topics;           // Subscriptions, sharded by connection
+    int topic_shard_count;
+    int cork;
+} ws_server_t;
+
+
 // Function declarations
+void ws_server_config_init(ws_server_config_t *config);
 ws_server_t* ws_server_create(int port);
+ws_server_t* ws_server_create_ex(const ws_server_config_t *config);
 int ws_server_start(ws_server_t *server);
 void ws_server_stop(ws_server_t *server);
 void ws_server_destroy(ws_server_t *server);
 void ws_server_set_event_target(ws_server_t *server, ws_event_target_t *target);
+int ws_server_add_extension(ws_server_t *server, const ws_extension_t *extension);
 
-int ws_handshake(int client_socket);
+int ws_handshake(ws_client_t *client);
+int ws_handshake_response(ws_client_t *client, char *request, char *response, size_t response_size);
+void ws_http_parser_init(ws_http_parser_t *parser);
+int ws_http_parser_feed(ws_http_parser_t *parser, const char *data, size_t length);
+int ws_handshake_accept(ws_client_t *client, const ws_http_parser_t *parser, char *request,
+                        char *response, size_t response_size);
+int ws_handshake_reject(uint16_t status, char *response, size_t response_size);
 int ws_parse_frame(const uint8_t *data, size_t length, ws_frame_t *frame);
+void ws_parser_init(ws_parser_t *parser, uint64_t max_payload, int require_mask);
+void ws_parser_reset(ws_parser_t *parser);
+void ws_parser_destroy(ws_parser_t *parser);
+int ws_parser_feed(ws_parser_t *parser, uint8_t *data, size_t length,
+                   ws_frame_handler_t on_frame, void *ctx);
 int ws_send_frame(int socket, ws_opcode_t opcode, const uint8_t *payload, size_t length);
 int ws_send_text(int socket, const char *message);
 int ws_send_binary(int socket, const uint8_t *data, size_t length);
 int ws_send_ping(int socket, const uint8_t *data, size_t length);
 int ws_send_pong(int socket, const uint8_t *data, size_t length);
 int ws_send_close(int socket, uint16_t code, const char *reason);
+size_t ws_frame_header_encode(uint8_t *header, ws_opcode_t opcode, size_t length);
+size_t ws_fragment_header_encode(uint8_t *header, ws_opcode_t opcode, size_t length, int fin);
+ws_shared_buffer_t* ws_frame_encode(ws_opcode_t opcode, const uint8_t *payload, size_t length);
+
+// Fan-out: encode once, queue the same buffer to every matching client
+typedef int (*ws_client_filter_t)(ws_client_t *client);
+int ws_server_broadcast(ws_server_t *server, ws_opcode_t opcode, const uint8_t *data, size_t length,
+                        ws_client_filter_t filter);
+
+// Topics: queue a message, encoded once, to the connections subscribed to it
+int ws_server_subscribe(ws_client_t *client, const char *topic);
+int ws_server_unsubscribe(ws_client_t *client, const char *topic);
+int ws_server_publish(ws_server_t *server, const char *topic, ws_opcode_t opcode, const uint8_t *data,
+                      size_t length);
+
+// Client-level send API (safe in every server mode)
+int ws_client_send_frame(ws_client_t *client, ws_opcode_t opcode, const uint8_t *payload, size_t length);
+int ws_client_send_text(ws_client_t *client, const char *message);
+int ws_client_send_binary(ws_client_t *client, const uint8_t *data, size_t length);
+int ws_client_send_close(ws_client_t *client, uint16_t code, const char *reason);
+int ws_client_writable(ws_client_t *client);
+int ws_client_flush(ws_client_t *client);
+ws_client_id_t ws_client_id(const ws_client_t *client);
+ws_client_t* ws_server_find_client(ws_server_t *server, ws_client_id_t id);
+int ws_server_send_to(ws_server_t *server, ws_client_id_t id, ws_opcode_t opcode, const uint8_t *payload,
+                      size_t length);
+size_t ws_client_buffered_amount(ws_client_t *client);
+
+// Internal: shared by the threaded and epoll I/O models
+int ws_server_listen(ws_server_t *server, int reuseport);
+int ws_client_table_init(ws_client_table_t *table, int max_clients, ws_server_t *server, ws_worker_t *worker);
+void ws_client_table_destroy(ws_client_table_t *table);
+ws_client_t* ws_client_table_acquire(ws_client_table_t *table);
+void ws_client_table_release(ws_client_table_t *table, ws_client_t *client);
+ws_client_t* ws_client_table_slot(ws_client_table_t *table, int index);
+int ws_worker_init(ws_worker_t *worker, ws_server_t *server, int index, int max_clients);
+int ws_worker_start(ws_worker_t *worker);
+void ws_worker_stop(ws_worker_t *worker);
+void ws_worker_wake(ws_worker_t *worker);
+void ws_worker_destroy(ws_worker_t *worker);
+void ws_client_handle_frame(ws_client_t *client, ws_frame_t *frame);
+int ws_client_expire(ws_client_t *client, uint64_t now, uint64_t *next);
+int ws_client_awaiting_close(ws_client_t *client);
+void ws_event_loop_notify_locked(ws_client_t *client);
+void ws_client_reset(ws_client_t *client);
+int ws_client_process_data(ws_client_t *client, uint8_t *data, size_t length);
+int ws_server_limits_init(ws_server_t *server, const ws_server_config_t *config);
+void ws_server_limits_destroy(ws_server_t *server);
+void ws_client_limits_attach(ws_client_t *client);
+void ws_client_limits_detach(ws_client_t *client);
+int ws_client_limits_charge(ws_client_t *client, unsigned messages, size_t bytes);
+int ws_client_limits_wait(ws_client_t *client);
+void ws_client_emit_connection(ws_client_t *client);
+void ws_client_emit_close(ws_client_t *client);
+void ws_client_emit_error(ws_client_t *client, const char *error);
+void ws_client_emit_drain(ws_client_t *client);
+int ws_client_attach_thread(ws_client_t *client);
+void ws_client_detach_thread(ws_client_t *client);
+int ws_client_output_pending(ws_client_t *client);
+void ws_client_cork(ws_client_t *client);
+int ws_client_uncork(ws_client_t *client);
+int ws_client_write_raw(ws_client_t *client, const uint8_t *data, size_t length);
+int ws_client_send_shared(ws_client_t *client, ws_shared_buffer_t *buffer);
+int ws_client_send_shared_frames(ws_client_t *client, ws_shared_buffer_t **frames, size_t count);
+int ws_client_send_shared_frames_to(ws_client_t *client, uint32_t generation, ws_shared_buffer_t **frames,
+                                    size_t count);
+int ws_client_send_frame_to(ws_client_t *client, uint32_t generation, ws_opcode_t opcode,
+                            const uint8_t *payload, size_t length);
+
+// A message being fanned out: encoded once, shared by every recipient
+typedef struct {
+    ws_opcode_t opcode;
+    const uint8_t *data;
+    size_t length;
+    ws_shared_buffer_t *frame;
+    ws_shared_buffer_t **frames;        // The plain message: &frame, or its fragments past fragment_size
+    size_t frame_count;
+    ws_shared_buffer_t *compressed;     // Built on first use for no_context_takeover clients
+    int compress_failed;
+    ws_client_filter_t filter;
+    int queued;
+} ws_broadcast_t;
+
+int ws_broadcast_begin(ws_broadcast_t *broadcast, ws_server_t *server, ws_opcode_t opcode, const uint8_t *data,
+                       size_t length);
+int ws_broadcast_send(ws_broadcast_t *broadcast, ws_client_t *client, uint32_t generation);
+void ws_broadcast_end(ws_broadcast_t *broadcast);
+int ws_server_topics_init(ws_server_t *server, int shards);
+void ws_server_topics_destroy(ws_server_t *server);
+void ws_client_unsubscribe_all(ws_client_t *client);
+typedef void (*ws_client_visitor_t)(ws_client_t *client, void *ctx);
+int ws_handshake_read(ws_client_t *client, char *buffer, size_t size);
+void ws_client_table_foreach(ws_client_table_t *table, ws_client_visitor_t visit, void *ctx);
+void ws_server_foreach_client(ws_server_t *server, ws_client_visitor_t visit, void *ctx);
+void ws_extensions_negotiate(ws_client_t *client, char **offers, int offer_count, char *line, size_t line_size);
+int ws_extensions_encode_locked(ws_client_t *client, ws_opcode_t opcode, const uint8_t *payload, size_t length,
+                                uint8_t **output, size_t *output_len, uint8_t *rsv);
+int ws_extensions_decode(ws_client_t *client, uint8_t rsv, const uint8_t *input, size_t input_len,
+                         uint8_t **output, size_t *output_len, uint16_t *error);
+const ws_extension_slot_t* ws_extensions_stream_decoder(ws_client_t *client, uint8_t rsv);
+void ws_client_message_frame(ws_client_t *client, ws_frame_t *frame);
+void ws_client_message_reset(ws_client_t *client);
+void ws_extensions_destroy_locked(ws_client_t *client);
+
+// Size-classed pool with per-thread caches; any thread may free a block
+typedef struct {
+    uint64_t hits;              // Served from a thread cache
+    uint64_t misses;            // Fell through to malloc
+    size_t bytes_held;          // Idle in thread caches
+    size_t bytes_in_use;        // Handed out and not yet freed
+} ws_pool_stats_t;
+
+void* ws_pool_alloc(size_t size);
+void* ws_pool_realloc(void *ptr, size_t size);
+void ws_pool_free(void *ptr);
+void ws_pool_get_stats(ws_pool_stats_t *stats);
 
 // Utility functions
-char* ws_base64_encode(const uint8_t *data, size_t length);
-int ws_base64_decode(const char *input, uint8_t *output, size_t *output_length);
-void ws_generate_accept_key(const char *client_key, char *accept_key);
-int ws_validate_utf8(const uint8_t *data, size_t length);
-void ws_apply_mask(uint8_t *data, size_t length, const uint8_t *mask);
+#define WS_BASE64_ENCODED_SIZE(length) (((length) + 2) / 3 * 4 + 1)  // Including the NUL
+#define WS_SHA1_DIGEST_SIZE 20
+#define WS_ACCEPT_KEY_SIZE WS_BASE64_ENCODED_SIZE(WS_SHA1_DIGEST_SIZE)
 
-// Buffer utilities
 typedef struct {
-    uint8_t *data;
-    size_t size;
-    size_t capacity;
-} ws_buffer_t;
+    uint32_t state[5];
+    uint64_t length;            // Bytes hashed so far
+    uint8_t block[64];
+} ws_sha1_t;
 
-ws_buffer_t* ws_buffer_create(size_t initial_capacity);
-void ws_buffer_destroy(ws_buffer_t *buffer);
-int ws_buffer_append(ws_buffer_t *buffer, const uint8_t *data, size_t length);
-void ws_buffer_clear(ws_buffer_t *buffer);
+size_t ws_base64_encode(const uint8_t *data, size_t length, char *output);
+int ws_base64_decode(const char *input, size_t input_len, uint8_t *output, size_t *output_length);
+void ws_sha1_init(ws_sha1_t *ctx);
+void ws_sha1_update(ws_sha1_t *ctx, const uint8_t *data, size_t length);
+void ws_sha1_final(ws_sha1_t *ctx, uint8_t digest[WS_SHA1_DIGEST_SIZE]);
+void ws_generate_accept_key(const char *client_key, char *accept_key);
+int ws_validate_utf8(const uint8_t *data, size_t length);
+void ws_utf8_init(ws_utf8_state_t *state);
+int ws_utf8_validate_chunk(ws_utf8_state_t *state, const uint8_t *data, size_t length);
+int ws_utf8_finish(const ws_utf8_state_t *state);
+void ws_apply_mask(uint8_t *data, size_t length, const uint8_t *mask);
+const char* ws_mask_kernel(void);
+uint64_t ws_monotonic_ms(void);
+uint64_t ws_monotonic_ns(void);
 
 // Compression support (permessage-deflate)
-typedef struct {
-    z_stream deflate_stream;
-    z_stream inflate_stream;
+typedef struct ws_zstream ws_zstream_t;
+
+// Streams are created on first use. Without context takeover in a direction
+// no stream is kept at all: one is borrowed from a per-thread pool for the
+// duration of each message.
+typedef struct ws_compression {
+    ws_zstream_t *deflater;
+    ws_zstream_t *inflater;
+    ws_deflate_params_t params;
+    size_t threshold;           // Messages below this are sent uncompressed
+    ws_zstream_t *message_inflater; // Held across the fragments of one message
+    size_t message_total;       // Bytes inflated for that message so far
+    int message_ended;          // It hit a BFINAL block; the rest is ignored
     int initialized;
+    uint16_t error;             // Close code describing the last inflate failure
 } ws_compression_t;
 
-ws_compression_t* ws_compression_create(void);
+// Built-in extension registered by ws_server_create_ex when enabled
+extern const ws_extension_t ws_permessage_deflate;
+
+// Receives decompressed output piece by piece; return -1 to abort
+typedef ws_data_sink_t ws_inflate_sink_t;
+
+int ws_deflate_negotiate(const char *offers, const ws_deflate_params_t *limits, ws_deflate_params_t *params,
+                         char *response, size_t response_size);
+ws_shared_buffer_t* ws_deflate_frame_encode(const ws_deflate_params_t *params, ws_opcode_t opcode,
+                                            const uint8_t *payload, size_t length);
+ws_compression_t* ws_compression_create(const ws_deflate_params_t *params);
 void ws_compression_destroy(ws_compression_t *comp);
+// Both work on whole message payloads without the 00 00 ff ff tail.
+// Output buffers come from the pool; release them with ws_pool_free
 int ws_compression_deflate(ws_compression_t *comp, const uint8_t *input, size_t input_len, uint8_t **output, size_t *output_len);
-int ws_compression_inflate(ws_compression_t *comp, const uint8_t *input, size_t input_len, uint8_t **output, size_t *output_len);
+int ws_compression_inflate(ws_compression_t *comp, const uint8_t *input, size_t input_len, size_t max_output,
+                           uint8_t **output, size_t *output_len);
+int ws_compression_inflate_stream(ws_compression_t *comp, const uint8_t *input, size_t input_len, size_t max_output,
+                                  ws_inflate_sink_t sink, void *ctx);
+int ws_compression_inflate_fragment(ws_compression_t *comp, const uint8_t *input, size_t input_len, int final,
+                                    size_t max_output, ws_inflate_sink_t sink, void *ctx);
 
-// Rate limiter
+// Rate limiter: max_requests per window, as a token bucket; thread-safe
 typedef struct {
-    time_t last_reset;
-    int count;
-    int max_requests;
-    int window_seconds;
+    ws_token_bucket_t bucket;
 } ws_rate_limiter_t;
 
 ws_rate_limiter_t* ws_rate_limiter_create(int max_requests, int window_seconds);
@@ -0,0 +1,158 @@
+#include "websocket.h"
+
+// Shared buffers are immutable once filled, so one encoded frame can sit in
+// many connections' write queues at once; the last release frees it.
+ws_shared_buffer_t* ws_shared_buffer_create(size_t length) {
+    ws_shared_buffer_t *buffer = ws_pool_alloc(sizeof(ws_shared_buffer_t) + length);
+    if (!buffer) return NULL;
+
+    buffer->refcount = 1;
+    buffer->length = length;
+    return buffer;
+}
+
+ws_shared_buffer_t* ws_shared_buffer_ref(ws_shared_buffer_t *buffer) {
+    __atomic_add_fetch(&buffer->refcount, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+void ws_shared_buffer_release(ws_shared_buffer_t *buffer) {
+    if (buffer && __atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        ws_pool_free(buffer);
+    }
+}
+
+void ws_write_queue_init(ws_write_queue_t *queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->urgent = NULL;
+    queue->bytes = 0;
+    queue->count = 0;
+}
+
+// Append buffer (from offset on) to the queue; takes its own reference
+int ws_write_queue_push(ws_write_queue_t *queue, ws_shared_buffer_t *buffer, size_t offset) {
+    ws_write_chunk_t *chunk = ws_pool_alloc(sizeof(ws_write_chunk_t));
+    if (!chunk) return -1;
+
+    chunk->buffer = ws_shared_buffer_ref(buffer);
+    chunk->offset = offset;
+    chunk->next = NULL;
+
+    if (queue->tail) {
+        queue->tail->next = chunk;
+    } else {
+        queue->head = chunk;
+    }
+    queue->tail = chunk;
+
+    queue->bytes += buffer->length - offset;
+    queue->count++;
+    return 0;
+}
+
+// Put buffer ahead of everything not yet started, behind earlier urgent
+// chunks, so a pong waits for at most the frame on the wire
+int ws_write_queue_push_urgent(ws_write_queue_t *queue, ws_shared_buffer_t *buffer, size_t offset) {
+    ws_write_chunk_t *after = queue->urgent;
+    if (!after && queue->head && queue->head->offset > 0) after = queue->head;
+
+    ws_write_chunk_t *chunk = ws_pool_alloc(sizeof(ws_write_chunk_t));
+    if (!chunk) return -1;
+
+    chunk->buffer = ws_shared_buffer_ref(buffer);
+    chunk->offset = offset;
+
+    if (after) {
+        chunk->next = after->next;
+        after->next = chunk;
+    } else {
+        chunk->next = queue->head;
+        queue->head = chunk;
+    }
+    if (!chunk->next) {
+        queue->tail = chunk;
+    }
+    queue->urgent = chunk;
+
+    queue->bytes += buffer->length - offset;
+    queue->count++;
+    return 0;
+}
+
+static void ws_write_queue_pop(ws_write_queue_t *queue) {
+    ws_write_chunk_t *chunk = queue->head;
+
+    queue->head = chunk->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    if (queue->urgent == chunk) {
+        queue->urgent = NULL;
+    }
+    queue->count--;
+
+    ws_shared_buffer_release(chunk->buffer);
+    ws_pool_free(chunk);
+}
+
+// Gather-write queued chunks, never blocking, until the queue is empty (or,
+// with urgent_only, its urgent chunks are written) or the socket is full.
+// Returns 0 when done, 1 when data is still pending, -1 on error.
+static int ws_write_queue_write(ws_write_queue_t *queue, int socket, int urgent_only) {
+    struct iovec iov[WS_WRITE_IOV_MAX];
+    struct msghdr msg;
+
+    while (urgent_only ? queue->urgent != NULL : queue->head != NULL) {
+        int count = 0;
+        for (ws_write_chunk_t *chunk = queue->head; chunk && count < WS_WRITE_IOV_MAX; chunk = chunk->next) {
+            iov[count].iov_base = chunk->buffer->data + chunk->offset;
+            iov[count].iov_len = chunk->buffer->length - chunk->offset;
+            count++;
+            if (urgent_only && chunk == queue->urgent) break;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+
+        queue->bytes -= sent;
+
+        // Release fully written chunks, then note progress in the partial one
+        while (queue->head && (size_t)sent >= queue->head->buffer->length - queue->head->offset) {
+            sent -= queue->head->buffer->length - queue->head->offset;
+            ws_write_queue_pop(queue);
+        }
+
+        if (queue->head) {
+            queue->head->offset += sent;
+        }
+    }
+
+    return 0;
+}
+
+int ws_write_queue_flush(ws_write_queue_t *queue, int socket) {
+    return ws_write_queue_write(queue, socket, 0);
+}
+
+// Write only the pings and pongs put ahead of the rest, e.g. between two
+// frames of a message being written around the queue
+int ws_write_queue_flush_urgent(ws_write_queue_t *queue, int socket) {
+    return ws_write_queue_write(queue, socket, 1);
+}
+
+void ws_write_queue_clear(ws_write_queue_t *queue) {
+    while (queue->head) {
+        ws_write_queue_pop(queue);
+    }
+
+    queue->bytes = 0;
+}